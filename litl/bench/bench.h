@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Helpers shared by the micro-benchmarks.
+ */
+
+#define MAX_THREADS 256
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Burn the CPU for ns nanoseconds */
+static inline void busy_ns(long ns)
+{
+	uint64_t start = now_ns();
+	while (now_ns() - start < (uint64_t)ns)
+		;
+}
@@ -10,7 +10,15 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+
+/* Timestamps from PAPI if built with -DUSE_PAPI (make PAPI=1), otherwise
+ * straight from the TSC: both count cycles */
+#ifdef USE_PAPI
 #include <papi.h>
+#define get_cycles() PAPI_get_real_cyc()
+#else
+#define get_cycles() ((long long)__builtin_ia32_rdtsc())
+#endif
 
 /* Define Platform Here */
 #define r74x
@@ -120,9 +128,9 @@ void request_normal(int tid)
 #ifdef	LIBHTLL_INTERFACE
 	segment_start(0);
 #endif
-	tt_startp = PAPI_get_real_cyc();
+	tt_startp = get_cycles();
 	pthread_mutex_lock(&global_lock);
-	tt_endp = PAPI_get_real_cyc();
+	tt_endp = get_cycles();
 	
 	// delay_nops(delay);
 	global_cnt[tid]++;
@@ -186,9 +194,12 @@ void print_help(void)
 	printf("    -h print this message\n");
 	printf("    -t [thread num]\n");
 	printf("    -g [number of visited shared cache lines in CS]\n");
+	printf("    -s [same, for the threads below -S (the CS length)]\n");
+	printf("    -S [number of threads with the -s CS, all by default]\n");
 	printf("    -d [delay between 2 acquistions]\n");
-	printf("    -p [every p thread have one ux thread]n");
+	printf("    -p [every p thread have one ux thread]\n");
 	printf("    -T [measure time (seconds)]\n");
+	printf("    -l [segment latency target (ns)]\n");
 }
 
 int main(int argc, char *argv[])
@@ -203,7 +214,7 @@ int main(int argc, char *argv[])
 	srand(10);
 	mode = 0;
 	delay = 100;
-	target_latency = 100000;
+	target_latency = 50000;
 	long_number_of_shared_variables = 5120;
 	short_number_of_shared_variables = 32;
 	while ((command = getopt(argc, argv, "m:g:u:s:p:d:t:hT:r:l:S:")) != -1) {
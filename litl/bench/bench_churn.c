@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+/*
+ * Lock churn: every thread keeps creating, using and destroying mutexes
+ * (heap allocated, so addresses are recycled by malloc).  The resident set
+ * size is printed periodically and must stay flat when destroyed locks are
+ * reclaimed.
+ */
+
+#define WINDOW 64
+
+long iterations = 1000000;
+long report_every = 1000000;
+volatile long total_done;
+volatile int threads_done;
+
+static long rss_kb(void)
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void *thread_entry(void *arg)
+{
+	pthread_mutex_t *live[WINDOW] = { 0 };
+
+	(void)arg;
+	for (long i = 0; i < iterations; i++) {
+		int slot = i % WINDOW;
+
+		// Keep a few locks alive so that destroy races with other users
+		// of the table, then recycle the oldest one
+		if (live[slot]) {
+			pthread_mutex_destroy(live[slot]);
+			free(live[slot]);
+		}
+		live[slot] = malloc(sizeof(pthread_mutex_t));
+		pthread_mutex_init(live[slot], NULL);
+		pthread_mutex_lock(live[slot]);
+		pthread_mutex_unlock(live[slot]);
+
+		if ((i + 1) % report_every == 0)
+			__sync_fetch_and_add(&total_done, report_every);
+	}
+	for (int slot = 0; slot < WINDOW; slot++) {
+		if (live[slot]) {
+			pthread_mutex_destroy(live[slot]);
+			free(live[slot]);
+		}
+	}
+	__sync_fetch_and_add(&threads_done, 1);
+	return NULL;
+}
+
+void print_help(void)
+{
+	printf("Lock create/destroy churn micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -t [thread num]\n");
+	printf("    -n [number of mutexes created per thread]\n");
+	printf("    -i [report interval, in mutexes per thread]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[MAX_THREADS];
+	int nb_thread = 4;
+	int command;
+
+	while ((command = getopt(argc, argv, "ht:n:i:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 't':
+			nb_thread = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 'i':
+			report_every = atol(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_thread < 1 || nb_thread > MAX_THREADS)
+		nb_thread = 4;
+	if (report_every < 1)
+		report_every = iterations;
+
+	uint64_t start = now_ns();
+	printf("start rss %ld kB\n", rss_kb());
+	for (int i = 0; i < nb_thread; i++)
+		pthread_create(&tid[i], NULL, thread_entry, NULL);
+
+	long reported = 0;
+	while (threads_done < nb_thread) {
+		long done = total_done;
+		if (done > reported) {
+			printf("%ld mutexes rss %ld kB\n", done, rss_kb());
+			fflush(stdout);
+			reported = done;
+		}
+		usleep(10000);
+	}
+	for (int i = 0; i < nb_thread; i++)
+		pthread_join(tid[i], NULL);
+
+	uint64_t end = now_ns();
+	printf("end rss %ld kB, %.1lf ns per create/lock/unlock/destroy\n",
+	       rss_kb(), (double)(end - start) / (iterations * nb_thread));
+	return 0;
+}
@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Memory footprint of the lock objects: creates many mutexes, uses each of
+ * them once so that the library builds its lock object, and reports the
+ * resident memory added per mutex (the pthread_mutex_t array itself is
+ * touched beforehand and not counted).
+ */
+
+static long rss_kb(void)
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void print_help(void)
+{
+	printf("Lock memory footprint micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -n [number of mutexes]\n");
+	printf("    -s use statically initialized mutexes (no pthread_mutex_init)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long nb_mutex = 1000000;
+	int static_init = 0;
+	int command;
+
+	while ((command = getopt(argc, argv, "hn:s")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 'n':
+			nb_mutex = atol(optarg);
+			break;
+		case 's':
+			static_init = 1;
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_mutex < 1)
+		nb_mutex = 1;
+
+	pthread_mutex_t *mutexes = malloc(nb_mutex * sizeof(pthread_mutex_t));
+	// Fault the array in (malloc + memset 0 may be turned into calloc)
+	volatile char *touch = (volatile char *)mutexes;
+	for (size_t off = 0; off < nb_mutex * sizeof(pthread_mutex_t);
+	     off += 4096)
+		touch[off] = 1;
+	memset(mutexes, 0, nb_mutex * sizeof(pthread_mutex_t));
+
+	long before = rss_kb();
+	for (long i = 0; i < nb_mutex; i++) {
+		if (!static_init)
+			pthread_mutex_init(&mutexes[i], NULL);
+		pthread_mutex_lock(&mutexes[i]);
+		pthread_mutex_unlock(&mutexes[i]);
+	}
+	long after = rss_kb();
+
+	printf("%ld mutexes: rss %ld kB -> %ld kB, %.1lf bytes per mutex\n",
+	       nb_mutex, before, after,
+	       (double)(after - before) * 1024 / nb_mutex);
+	return 0;
+}
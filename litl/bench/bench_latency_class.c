@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <libhtll.h>
+#include "bench.h"
+
+/*
+ * Mixed latency classes on one lock: critical threads take it in a segment
+ * with a tight latency target, loose threads in a segment with a loose one,
+ * background threads outside of segments.  Reports the lock acquisition
+ * latency of each class (p50, p99, max).
+ * Linked against libhtll (see the Makefile), run with LD_LIBRARY_PATH=lib.
+ */
+
+#define MAX_SAMPLES (1 << 20)
+
+enum { CRITICAL, LOOSE, BACKGROUND, CLASSES };
+static const char *class_name[CLASSES] = { "critical", "loose", "background" };
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile int stop;
+long cs_ns = 1000;
+long think_ns = 5000;
+uint64_t target_ns[CLASSES] = { 20000, 10000000, 0 };
+
+struct worker {
+	int class;
+	long count;
+	uint64_t *samples;
+};
+
+void *thread_entry(void *arg)
+{
+	struct worker *w = arg;
+	int segment = w->class;
+
+	while (!stop) {
+		if (w->class != BACKGROUND)
+			segment_start(segment);
+		uint64_t start = now_ns();
+		pthread_mutex_lock(&mutex);
+		uint64_t wait = now_ns() - start;
+		busy_ns(cs_ns);
+		pthread_mutex_unlock(&mutex);
+		if (w->class != BACKGROUND)
+			segment_end(segment, target_ns[w->class]);
+
+		if (w->count < MAX_SAMPLES)
+			w->samples[w->count++] = wait;
+		busy_ns(think_ns);
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+void print_help(void)
+{
+	printf("HTLL latency class micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -c [number of critical threads]\n");
+	printf("    -l [number of loose threads]\n");
+	printf("    -b [number of background threads]\n");
+	printf("    -s [critical section length, in ns]\n");
+	printf("    -t [think time between critical sections, in ns]\n");
+	printf("    -d [duration, in seconds]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[MAX_THREADS];
+	struct worker workers[MAX_THREADS];
+	int nb[CLASSES] = { 2, 2, 2 };
+	int duration = 5;
+	int command;
+
+	while ((command = getopt(argc, argv, "hc:l:b:s:t:d:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 'c':
+			nb[CRITICAL] = atoi(optarg);
+			break;
+		case 'l':
+			nb[LOOSE] = atoi(optarg);
+			break;
+		case 'b':
+			nb[BACKGROUND] = atoi(optarg);
+			break;
+		case 's':
+			cs_ns = atol(optarg);
+			break;
+		case 't':
+			think_ns = atol(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+
+	int nb_thread = 0;
+	for (int c = 0; c < CLASSES; c++) {
+		for (int i = 0; i < nb[c] && nb_thread < MAX_THREADS; i++) {
+			struct worker *w = &workers[nb_thread++];
+			w->class = c;
+			w->count = 0;
+			w->samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+		}
+	}
+	for (int i = 0; i < nb_thread; i++)
+		pthread_create(&tid[i], NULL, thread_entry, &workers[i]);
+	sleep(duration);
+	stop = 1;
+	for (int i = 0; i < nb_thread; i++)
+		pthread_join(tid[i], NULL);
+
+	double p99[CLASSES] = { 0 }, max[CLASSES] = { 0 };
+
+	for (int c = 0; c < CLASSES; c++) {
+		long total = 0;
+		for (int i = 0; i < nb_thread; i++)
+			if (workers[i].class == c)
+				total += workers[i].count;
+		if (!total)
+			continue;
+
+		uint64_t *all = malloc(total * sizeof(uint64_t));
+		long n = 0;
+		for (int i = 0; i < nb_thread; i++) {
+			if (workers[i].class != c)
+				continue;
+			for (long j = 0; j < workers[i].count; j++)
+				all[n++] = workers[i].samples[j];
+		}
+		qsort(all, n, sizeof(uint64_t), cmp_u64);
+		p99[c] = (double)all[n * 99 / 100] / 1000;
+		max[c] = (double)all[n - 1] / 1000;
+		printf("%-10s %8ld locks, wait p50 %.1lf us p99 %.1lf us max %.1lf us\n",
+		       class_name[c], n, (double)all[n / 2] / 1000, p99[c],
+		       max[c]);
+		free(all);
+	}
+	/* What the reordering costs the threads outside of segments */
+	printf("critical p99 %.1lf us, background p99 %.1lf us max %.1lf us\n",
+	       p99[CRITICAL], p99[BACKGROUND], max[BACKGROUND]);
+	return 0;
+}
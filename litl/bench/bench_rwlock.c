@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+/*
+ * Read-mostly throughput: threads share one rwlock protecting a small table,
+ * a given percentage of the operations read it under the read lock and the
+ * others update it under the write lock.  Reports the aggregate throughput
+ * after a fixed duration.
+ */
+
+#define TABLE_SIZE 16
+
+pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+volatile uint64_t table[TABLE_SIZE];
+volatile int stop;
+int read_pct = 90;
+
+struct worker {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t torn;
+	char __pad[64 - 3 * sizeof(uint64_t)];
+} __attribute__((aligned(64)));
+
+struct worker workers[MAX_THREADS];
+
+void *thread_entry(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int seed = (uintptr_t) arg;
+
+	while (!stop) {
+		if ((int)(rand_r(&seed) % 100) < read_pct) {
+			pthread_rwlock_rdlock(&rwlock);
+			uint64_t first = table[0];
+			for (int i = 1; i < TABLE_SIZE; i++)
+				if (table[i] != first)
+					w->torn++;
+			pthread_rwlock_unlock(&rwlock);
+			w->reads++;
+		} else {
+			pthread_rwlock_wrlock(&rwlock);
+			for (int i = 0; i < TABLE_SIZE; i++)
+				table[i]++;
+			pthread_rwlock_unlock(&rwlock);
+			w->writes++;
+		}
+	}
+	return NULL;
+}
+
+void print_help(void)
+{
+	printf("Reader-writer lock micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -t [thread num]\n");
+	printf("    -r [percentage of read operations]\n");
+	printf("    -d [duration in ms]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[MAX_THREADS];
+	int nb_thread = 4;
+	long duration_ms = 1000;
+	int command;
+
+	while ((command = getopt(argc, argv, "ht:r:d:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 't':
+			nb_thread = atoi(optarg);
+			break;
+		case 'r':
+			read_pct = atoi(optarg);
+			break;
+		case 'd':
+			duration_ms = atol(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_thread < 1 || nb_thread > MAX_THREADS)
+		nb_thread = 4;
+	if (read_pct < 0 || read_pct > 100)
+		read_pct = 90;
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < nb_thread; i++)
+		pthread_create(&tid[i], NULL, thread_entry, &workers[i]);
+	usleep(duration_ms * 1000);
+	stop = 1;
+	for (int i = 0; i < nb_thread; i++)
+		pthread_join(tid[i], NULL);
+	uint64_t end = now_ns();
+
+	uint64_t reads = 0, writes = 0, torn = 0;
+	for (int i = 0; i < nb_thread; i++) {
+		reads += workers[i].reads;
+		writes += workers[i].writes;
+		torn += workers[i].torn;
+	}
+	printf("%d threads, %d%% reads: %.0lf ops/s (%lu reads, %lu writes)\n",
+	       nb_thread, read_pct,
+	       (double)(reads + writes) * 1e9 / (end - start), reads, writes);
+	if (torn)
+		printf("error: %lu torn reads\n", torn);
+	return torn != 0;
+}
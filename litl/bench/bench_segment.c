@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <libhtll.h>
+#include "bench.h"
+
+/*
+ * Cost of the HTLL segment interface on the uncontended path, single thread:
+ * segment_start + lock + unlock + segment_end, against lock + unlock alone.
+ * Linked against libhtll (see the Makefile), run with LD_LIBRARY_PATH=lib.
+ */
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void print_help(void)
+{
+	printf("HTLL segment interface micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -n [number of iterations]\n");
+	printf("    -s [number of distinct segment ids used round-robin]\n");
+	printf("    -r [number of runs]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = 10000000;
+	int nb_segment = 1;
+	int runs = 5;
+	int command;
+
+	while ((command = getopt(argc, argv, "hn:s:r:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 's':
+			nb_segment = atoi(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_segment < 1 || nb_segment > 255)
+		nb_segment = 1;
+
+	for (int r = 0; r < runs; r++) {
+		uint64_t start = now_ns();
+		for (long i = 0; i < iterations; i++) {
+			pthread_mutex_lock(&mutex);
+			pthread_mutex_unlock(&mutex);
+		}
+		uint64_t mid = now_ns();
+		for (long i = 0; i < iterations; i++) {
+			int id = i % nb_segment;
+			segment_start(id);
+			pthread_mutex_lock(&mutex);
+			pthread_mutex_unlock(&mutex);
+			segment_end(id, 1000000);
+		}
+		uint64_t end = now_ns();
+
+		printf("lock+unlock %.2lf ns, with segment %.2lf ns\n",
+		       (double)(mid - start) / iterations,
+		       (double)(end - mid) / iterations);
+	}
+	return 0;
+}
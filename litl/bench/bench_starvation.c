@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <libhtll.h>
+#include "bench.h"
+
+/*
+ * Starvation of background threads under HTLL reorder windows: latency
+ * critical threads take the lock inside a segment with a tight latency
+ * target, background threads take it outside of any segment.  Reports how
+ * long the background threads waited for the lock, worst case included,
+ * and how many waits went over the starvation bound of the library
+ * (HTLL_STARVE_NS, plus the critical sections ahead of the handoff).
+ * Linked against libhtll (see the Makefile), run with LD_LIBRARY_PATH=lib.
+ */
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile int stop;
+long cs_ns = 1000;
+long target_ns = 1000;
+long bound_ns = 1000000;
+
+struct result {
+	long count;
+	uint64_t total;
+	uint64_t max;
+	long over;
+};
+
+void *critical_entry(void *arg)
+{
+	(void)arg;
+	while (!stop) {
+		segment_start(0);
+		pthread_mutex_lock(&mutex);
+		busy_ns(cs_ns);
+		pthread_mutex_unlock(&mutex);
+		segment_end(0, target_ns);
+	}
+	return NULL;
+}
+
+void *background_entry(void *arg)
+{
+	struct result *res = arg;
+
+	while (!stop) {
+		uint64_t start = now_ns();
+		pthread_mutex_lock(&mutex);
+		uint64_t wait = now_ns() - start;
+		busy_ns(cs_ns);
+		pthread_mutex_unlock(&mutex);
+
+		res->count++;
+		res->total += wait;
+		if (wait > res->max)
+			res->max = wait;
+		if (wait > (uint64_t)bound_ns)
+			res->over++;
+		busy_ns(cs_ns);
+	}
+	return NULL;
+}
+
+void print_help(void)
+{
+	printf("HTLL starvation micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -s [number of threads in segments]\n");
+	printf("    -b [number of background threads]\n");
+	printf("    -c [critical section length, in ns]\n");
+	printf("    -l [latency target of the segments, in ns]\n");
+	printf("    -d [duration, in seconds]\n");
+	printf("    -S [starvation bound to check the waits against, in ns]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[MAX_THREADS];
+	struct result res[MAX_THREADS] = { 0 };
+	int nb_critical = 4;
+	int nb_background = 2;
+	int duration = 5;
+	int command;
+
+	while ((command = getopt(argc, argv, "hs:b:c:l:d:S:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 's':
+			nb_critical = atoi(optarg);
+			break;
+		case 'b':
+			nb_background = atoi(optarg);
+			break;
+		case 'c':
+			cs_ns = atol(optarg);
+			break;
+		case 'l':
+			target_ns = atol(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'S':
+			bound_ns = atol(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_critical < 0 || nb_background < 1 ||
+	    nb_critical + nb_background > MAX_THREADS) {
+		nb_critical = 4;
+		nb_background = 2;
+	}
+
+	for (int i = 0; i < nb_critical; i++)
+		pthread_create(&tid[i], NULL, critical_entry, NULL);
+	for (int i = 0; i < nb_background; i++)
+		pthread_create(&tid[nb_critical + i], NULL, background_entry,
+			       &res[i]);
+	sleep(duration);
+	stop = 1;
+	for (int i = 0; i < nb_critical + nb_background; i++)
+		pthread_join(tid[i], NULL);
+
+	uint64_t worst = 0;
+	long count = 0, over = 0;
+	for (int i = 0; i < nb_background; i++) {
+		printf("background %d: %ld locks, wait avg %.1lf us max %.1lf us, %ld over the bound\n",
+		       i, res[i].count,
+		       res[i].count ? (double)res[i].total / res[i].count / 1000
+				    : 0.0, (double)res[i].max / 1000, res[i].over);
+		if (res[i].max > worst)
+			worst = res[i].max;
+		count += res[i].count;
+		over += res[i].over;
+	}
+	printf("starvation bound %.1lf us: %ld of %ld waits over it\n",
+	       (double)bound_ns / 1000, over, count);
+	printf("worst-case background wait %.1lf us\n", (double)worst / 1000);
+	return 0;
+}
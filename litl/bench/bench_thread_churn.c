@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+/*
+ * Thread churn: keeps replacing worker threads, the way a thread pool that
+ * recycles its workers does.  Each worker takes a shared mutex a few times,
+ * half of them return and the other half call pthread_exit.  Far more
+ * threads than the library's per-thread slots are created over the run.
+ */
+
+long nb_created = 100000;
+int ops_per_thread = 100;
+pthread_mutex_t shared = PTHREAD_MUTEX_INITIALIZER;
+volatile long counter;
+
+void *thread_entry(void *arg)
+{
+	for (int i = 0; i < ops_per_thread; i++) {
+		pthread_mutex_lock(&shared);
+		counter++;
+		pthread_mutex_unlock(&shared);
+	}
+	if ((uintptr_t) arg & 1)
+		pthread_exit(NULL);
+	return NULL;
+}
+
+void print_help(void)
+{
+	printf("Thread create/exit churn micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -t [number of live threads]\n");
+	printf("    -n [total number of threads created]\n");
+	printf("    -o [lock operations per thread]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[MAX_THREADS];
+	int nb_live = 8;
+	int command;
+
+	while ((command = getopt(argc, argv, "ht:n:o:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 't':
+			nb_live = atoi(optarg);
+			break;
+		case 'n':
+			nb_created = atol(optarg);
+			break;
+		case 'o':
+			ops_per_thread = atoi(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_live < 1 || nb_live > MAX_THREADS)
+		nb_live = 8;
+
+	uint64_t start = now_ns();
+	long created = 0;
+	for (int i = 0; i < nb_live && created < nb_created; i++, created++) {
+		int ret = pthread_create(&tid[i], NULL, thread_entry,
+					 (void *)(uintptr_t) created);
+		if (ret != 0) {
+			printf("pthread_create: %s\n", strerror(ret));
+			exit(1);
+		}
+	}
+	// Replace the oldest worker as soon as it is gone
+	for (long slot = 0; created < nb_created; created++, slot++) {
+		int i = slot % nb_live;
+		pthread_join(tid[i], NULL);
+		int ret = pthread_create(&tid[i], NULL, thread_entry,
+					 (void *)(uintptr_t) created);
+		if (ret != 0) {
+			printf("pthread_create failed after %ld threads: %s\n",
+			       created, strerror(ret));
+			exit(1);
+		}
+	}
+	for (int i = 0; i < nb_live && i < nb_created; i++)
+		pthread_join(tid[i], NULL);
+	uint64_t end = now_ns();
+
+	printf("%ld threads, counter %ld (expected %ld), %.1lf us per thread\n",
+	       nb_created, counter, nb_created * ops_per_thread,
+	       (double)(end - start) / 1000 / nb_created);
+	return counter != nb_created * ops_per_thread;
+}
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "bench.h"
+
+/*
+ * Uncontended lock+unlock cost, single thread.
+ * Run it through the liblock scripts (e.g. ./libhtll_original.sh
+ * bin/bench_uncontended) to measure the interposition overhead. -c adds
+ * mutexes that are initialized but never locked, so that the lookups of the
+ * ones in use go through a large lock table.
+ */
+
+#define MAX_MUTEXES 4096
+
+pthread_mutex_t mutexes[MAX_MUTEXES];
+
+void print_help(void)
+{
+	printf("Uncontended lock+unlock micro-benchmark\n");
+	printf("Usage:\n");
+	printf("    -h print this message\n");
+	printf("    -n [number of lock+unlock pairs]\n");
+	printf("    -m [number of mutexes used round-robin]\n");
+	printf("    -N [nesting depth: locks held at once]\n");
+	printf("    -r [number of runs]\n");
+	printf("    -c [number of mutexes initialized but never locked]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = 10000000;
+	int nb_mutex = 1;
+	int nesting = 1;
+	int runs = 5;
+	long nb_cold = 0;
+	int command;
+
+	while ((command = getopt(argc, argv, "hn:m:N:r:c:")) != -1) {
+		switch (command) {
+		case 'h':
+			print_help();
+			exit(0);
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		case 'm':
+			nb_mutex = atoi(optarg);
+			break;
+		case 'N':
+			nesting = atoi(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'c':
+			nb_cold = atol(optarg);
+			break;
+		default:
+		case '?':
+			printf("unknown option:%s\n", optarg);
+			break;
+		}
+	}
+	if (nb_mutex < 1 || nb_mutex > MAX_MUTEXES)
+		nb_mutex = 1;
+	if (nesting < 1 || nesting > nb_mutex)
+		nesting = 1;
+
+	for (int i = 0; i < nb_mutex; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+	pthread_mutex_t *cold = nb_cold > 0 ? calloc(nb_cold, sizeof(*cold)) : NULL;
+	for (long i = 0; cold && i < nb_cold; i++)
+		pthread_mutex_init(&cold[i], NULL);
+
+	for (int r = 0; r < runs; r++) {
+		int cur = 0;
+		uint64_t start = now_ns();
+		for (long i = 0; i < iterations; i += nesting) {
+			for (int j = 0; j < nesting; j++)
+				pthread_mutex_lock(&mutexes[(cur + j) % nb_mutex]);
+			for (int j = nesting - 1; j >= 0; j--)
+				pthread_mutex_unlock(&mutexes
+						     [(cur + j) % nb_mutex]);
+			cur = (cur + nesting) % nb_mutex;
+		}
+		uint64_t end = now_ns();
+		printf("run %d: %.2lf ns per lock+unlock\n", r,
+		       (double)(end - start) / iterations);
+	}
+	return 0;
+}
@@ -26,37 +26,79 @@
 
 #include "padding.h"
 #define LOCK_ALGORITHM "HTLL"
+#define SUPPORT_LOCK_HINT 1
+#define SUPPORT_LOCK_BIND 1
 #define NEED_CONTEXT 0
 #define SUPPORT_WAITING 0
 
 #define PADDING 1
-#define HTLL_SPIN_TRIES_LOCK 8192
-#define HTLL_SPIN_TRIES_UNLOCK 128
+/* All durations are in nanoseconds, converted to ticks at startup */
+/* Spin budget while the hold time of a lock is unknown */
+#define HTLL_SPIN_LOCK_NS 4096
+#define HTLL_SPIN_MIN_NS 256
+#define HTLL_SPIN_MAX_NS 16384
+/* Waits expected to last longer than a futex sleep and wake are not spun on,
+ * and waits beyond HTLL_YIELD_MAX_NS are not yielded on either */
+#define HTLL_PARK_COST_NS 8000
+#define HTLL_YIELD_MAX_NS 65536
+#define HTLL_UNLOCK_DELAY_NS 64
+/* Spinlock waiters spin longer before parking */
+#define HTLL_SPIN_SPINLOCK_NS (8 * HTLL_SPIN_LOCK_NS)
+/* Segment waiters park until HTLL_WAIT_YIELD_NS before the end of their
+ * reorder window, then yield, then spin the last HTLL_WAIT_SPIN_NS */
+#define HTLL_WAIT_YIELD_NS 4000
+#define HTLL_WAIT_SPIN_NS 1000
+/* Timer slack of the threads that enter segments (the default is 50 us) */
+#define HTLL_TIMER_SLACK_NS 1000
+/* A waiter outside of segments woken HTLL_BYPASS_MAX times without getting
+ * the lock, or waiting for more than HTLL_STARVE_NS, gets it handed over */
+#define HTLL_BYPASS_MAX 8
+#define HTLL_STARVE_NS 1000000
+/* Segments with a latency target up to this are woken up first */
+#define HTLL_CRITICAL_LATENCY_NS 100000
+/* Spin backoff, in PAUSEs: the cap grows by the unit per spinner */
+#define HTLL_BACKOFF_UNIT 8
+#define HTLL_BACKOFF_MAX 1024
 
 #define UNLOCKED 0
 #define LOCKED 1
 #define UNCONTENDED 0
 #define CONTENDED 1
 #define LOCKED_AND_CONTENDED 257
+/* Third byte of the word: the lock was handed over to the starving waiter */
+#define HTLL_GRANTED 0x10000
+/* Fourth byte: a waiter parked on the word (or queued, with HTLL_EDF) since
+ * the last release, which clears it */
+#define HTLL_SLEEPING 0x1000000
 
-#define ADJUST_THRESHOLD 2047
-#define WAKE_MAX_THRESHOLD 32
-#define WAKE_MIN_THRESHOLD 16
-#define INCREASE_UNIT 512
-#define DECREASE_UNIT 256
+/* Weight of a new sample in the hold time averages: 1 / 2^shift */
+#define HTLL_EWMA_SHIFT 3
 
 #define DEFAULT_REORDER 10000
 #define MIN_REORDER 10000
 #define DEFAULT_ADJUST_UNIT 5000
 #define MIN_ADJUST_UNIT 1000
 #define SEGMENT_REQ_THRESHOLD 100
+/* Segments with an SLO are evaluated once HTLL_SLO_TAIL samples are expected
+ * above the target percentile; the window grows while the percentile is
+ * below the target by more than 1 / 2^HTLL_SLO_BAND_SHIFT */
+#define HTLL_SLO_TAIL 8
+#define HTLL_SLO_BAND_SHIFT 3
+/* Latency histogram: four buckets per power of two of nanoseconds */
+#define HTLL_SLO_BUCKETS 256
+/* Every HTLL_SEGMENT_FOLD segment_end, a thread folds its reorder window into
+ * the process-wide one, with a weight of 1 / 2^HTLL_SEGMENT_FOLD_SHIFT */
+#define HTLL_SEGMENT_FOLD 64
+#define HTLL_SEGMENT_FOLD_SHIFT 2
+/* State file: format version, locks and modules tracked, length of the
+ * segment names kept */
+#define HTLL_STATE_VERSION 1
+#define HTLL_STATE_LOCKS 4096
+#define HTLL_STATE_MODULES 64
+#define HTLL_STATE_NAME 64
 
-static inline void delay_ticks(const int cycles) {
-  int cy = cycles;
-  while (cy--) {
-    asm volatile("");
-  }
-}
+/* Unlike CPU_PAUSE (a nop), really yields the pipeline to the sibling */
+static inline void htll_pause(void) { asm volatile("pause" : : : "memory"); }
 
 static inline uint32_t htll_swap_uint32(volatile uint32_t *target, uint32_t x) {
   asm volatile("xchgl %0,%1"
@@ -76,44 +118,174 @@ static inline uint8_t htll_swap_uint8(volatile uint8_t *target, uint8_t x) {
   return x;
 }
 
-static inline uint64_t htll_getticks(void) {
-  unsigned hi, lo;
-  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
-  return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
-}
-
-#define HTLL_FOR_N_CYCLES(n, do)                                               \
-  {                                                                            \
-    uint64_t ___s = htll_getticks();                                           \
-    while (1) {                                                                \
-      do                                                                       \
-        ;                                                                      \
-      uint64_t ___e = htll_getticks();                                         \
-      if ((___e - ___s) > n) {                                                 \
-        break;                                                                 \
-      }                                                                        \
-    }                                                                          \
-  }
 #define CACHE_LINE_SIZE 64
 
+typedef union htll_word {
+  volatile unsigned u;
+  struct {
+    volatile unsigned char locked;
+    volatile unsigned char contended;
+  } b;
+} htll_word_t;
+
+#ifndef HTLL_COMPACT
+#define HTLL_COMPACT 0
+#endif
+
+/* Waiters queue up by deadline and the lock is handed over to the earliest
+ * one, instead of timed reorder windows */
+#ifndef HTLL_EDF
+#define HTLL_EDF 0
+#endif
+
+/* A waiter of the HTLL_EDF queue. Its deadline (in ticks) comes from the
+ * segment it is in, or its arrival time plus HTLL_STARVE_NS outside of
+ * segments. It sleeps on granted until the lock is handed over */
+typedef struct htll_waiter {
+  struct htll_waiter *next;
+  uint64_t deadline;
+  volatile unsigned int granted;
+} htll_waiter_t;
+
+/* Report the precision of the reorder windows at exit */
+#ifndef HTLL_STATS
+#define HTLL_STATS 0
+#endif
+
+/* Classes of the threads parked on a lock, most urgent first: segments with
+ * a tight latency target, other segments, threads outside of segments */
+#define HTLL_CLASS_CRITICAL 0
+#define HTLL_CLASS_LOOSE 1
+#define HTLL_CLASS_BACKGROUND 2
+#define HTLL_CLASSES 3
+
+/*
+ * Spin adaptation state, only touched on the contended paths. hold and gap
+ * average, in ticks, the hold time of the lock and the time from a release to
+ * the next acquisition by a waiter; they are only written by the owner.
+ * parked counts the threads parked on the lock word by class. site is the
+ * entry + 1 of the lock in the sites saved to the state file, 0 if none.
+ */
+#if HTLL_COMPACT
+/* Everything shares one line, still apart from the lock word */
+typedef __attribute__((aligned(CACHE_LINE_SIZE))) struct htll_state {
+  uint64_t hold;
+  uint64_t gap;
+  uint64_t released_at;
+  unsigned int spinners;
+  unsigned int parked[HTLL_CLASSES];
+  unsigned int site;
+#if HTLL_EDF
+  volatile int qlock;
+  htll_waiter_t *waiters;
+#endif
+} htll_state_t;
+#else
+typedef __attribute__((aligned(CACHE_LINE_SIZE))) struct htll_state {
+  uint64_t hold;
+  uint64_t gap;
+  uint64_t released_at;
+  unsigned int site;
+  uint8_t padding0[CACHE_LINE_SIZE - 3 * sizeof(uint64_t) - sizeof(unsigned)];
+  /* Threads in the spin phase, sizes their backoff */
+  unsigned int spinners;
+  unsigned int parked[HTLL_CLASSES];
+  uint8_t padding1[CACHE_LINE_SIZE - (1 + HTLL_CLASSES) * sizeof(unsigned)];
+#if HTLL_EDF
+  /* Waiters sorted by deadline, protected by qlock */
+  volatile int qlock;
+  htll_waiter_t *waiters;
+#endif
+} htll_state_t;
+#endif
+
+#if NO_INDIRECTION
+/*
+ * Stored directly inside pthread_mutex_t (or pthread_rwlock_t), so all zeros
+ * (PTHREAD_MUTEX_INITIALIZER) is an unlocked lock. The state is allocated on
+ * the first contended acquisition.
+ */
+typedef struct htll_lock {
+  htll_word_t l;
+  volatile unsigned int sleepers;
+  htll_state_t *state;
+  volatile uint64_t acquired_at;
+  volatile uint64_t hint;
+  volatile unsigned int starving;
+} htll_mutex_t;
+
+_Static_assert(sizeof(htll_mutex_t) <= sizeof(pthread_mutex_t),
+               "htll_mutex_t must fit in pthread_mutex_t");
+_Static_assert(sizeof(htll_mutex_t) <= sizeof(pthread_rwlock_t),
+               "htll_mutex_t must fit in pthread_rwlock_t");
+#else
 typedef __attribute__((aligned(CACHE_LINE_SIZE))) struct htll_lock {
-  union {
-    volatile unsigned u;
-    struct {
-      volatile unsigned char locked;
-      volatile unsigned char contended;
-    } b;
-  } l;
-  uint8_t padding[CACHE_LINE_SIZE - sizeof(unsigned)];
-  unsigned int ticks_spin;
-  uint8_t padding0[CACHE_LINE_SIZE - sizeof(unsigned)];
-  unsigned int cnt_unlock;
-  uint8_t padding1[CACHE_LINE_SIZE - sizeof(unsigned)];
-  unsigned int cnt_wake;
-  uint8_t padding2[CACHE_LINE_SIZE - sizeof(unsigned)];
-  unsigned int flag;
-  uint8_t padding3[CACHE_LINE_SIZE - sizeof(unsigned)];
+  htll_word_t l;
+  volatile unsigned int sleepers;
+  volatile uint64_t acquired_at;
+  volatile uint64_t hint;
+  volatile unsigned int starving;
+  uint8_t padding[CACHE_LINE_SIZE - 3 * sizeof(unsigned) -
+                  2 * sizeof(uint64_t)];
+  htll_state_t state;
 } htll_mutex_t;
+#endif
+/*
+ * sleepers counts the threads parked (or about to park) on the lock word,
+ * each adds itself before sleeping and removes itself once awake. Unlock only
+ * enters the kernel when it is non-zero, or when the word it released had
+ * HTLL_SLEEPING: past the release, a lock inside pthread_mutex_t may be gone.
+ *
+ * An owner that waited stamps acquired_at (in ticks); one that took the lock
+ * right away clears it, and the first waiter stamps it with its arrival, so
+ * that the fast path reads no clock. The owner sets hint to the length of its
+ * critical section when it gave one (0 otherwise). Waiters set the contended
+ * byte, so that the owner samples its hold time when it releases.
+ *
+ * starving is set by the one waiter (at most) that was overtaken too often.
+ * An unlock that sees it set does not release the lock but adds HTLL_GRANTED
+ * to the word, which hands it over to that waiter.
+ */
+
+#if !NO_INDIRECTION
+#define SUPPORT_RWLOCK 1
+#define HTLL_RW_SLOTS 8
+
+/*
+ * Reader-writer lock. Readers only touch one of HTLL_RW_SLOTS counters,
+ * picked by the CPU they run on, so that readers on different cores do not
+ * share a line. Writers serialize on an HTLL mutex (keeping its spinning and the
+ * segment reorder window), then raise the writer flag and wait for the
+ * reader counters to drain. Readers back off while the flag is up.
+ */
+typedef __attribute__((aligned(CACHE_LINE_SIZE))) struct htll_rwlock {
+  htll_mutex_t wlock;
+  /* 0: no writer, 1: writer in or waiting, 2: and readers are sleeping */
+  volatile uint32_t writer __attribute__((aligned(CACHE_LINE_SIZE)));
+  /* Set while the writer sleeps on rseq, bumped by leaving readers */
+  volatile uint32_t wsleep;
+  volatile uint32_t rseq;
+  void *volatile owner;
+  struct {
+    volatile int count;
+    uint8_t padding[CACHE_LINE_SIZE - sizeof(int)];
+  } readers[HTLL_RW_SLOTS] __attribute__((aligned(CACHE_LINE_SIZE)));
+} htll_rwlock_t;
+#else
+/* Without indirection, rwlocks are mapped to the mutex */
+#define SUPPORT_RWLOCK 0
+#endif
+
+/*
+ * Spinlock, stored directly inside pthread_spinlock_t in every variant (zero
+ * is unlocked). Same word as the mutex, without adaptation state: waiters
+ * spin for a bounded time, then park on the word.
+ */
+#define SUPPORT_SPINLOCK 1
+typedef htll_word_t htll_spinlock_t;
+
+_Static_assert(sizeof(htll_spinlock_t) <= sizeof(pthread_spinlock_t),
+               "htll_spinlock_t must fit in pthread_spinlock_t");
 
 typedef struct upmutex_cond1 {
   htll_mutex_t *m;
@@ -128,11 +300,38 @@ typedef struct upmutex_cond1 {
   { NULL, 0, 0 }
 typedef void *htll_context_t;
 
+/* Maximum nesting of segments */
+#define MAX_DEPTH 30
+
+/* Per-thread state, kept in the thread block of the interpose layer */
+typedef struct htll_thread {
+  /* Pages of segments, allocated by the first segment_start, each page on
+   * the first use of one of its segments */
+  struct htll_segment **segment;
+  struct htll_segment *cur_segment;
+  int cur_segment_id;
+  int stack_pos;
+  int segment_stack[MAX_DEPTH];
+#if HTLL_EDF
+  /* A thread waits for one lock at a time */
+  htll_waiter_t waiter;
+#endif
+#if SUPPORT_RWLOCK
+  /* Reader slot of the last read lock, left by the next read unlock */
+  int rw_slot;
+#endif
+} htll_thread_t;
+
 htll_mutex_t *htll_mutex_create(const pthread_mutexattr_t *attr);
 int htll_mutex_lock(htll_mutex_t *impl, htll_context_t *me);
+int htll_mutex_lock_expect(htll_mutex_t *impl, htll_context_t *me,
+                           uint64_t cs_ns);
 int htll_mutex_trylock(htll_mutex_t *impl, htll_context_t *me);
+int htll_mutex_timedlock(htll_mutex_t *impl, htll_context_t *me,
+                         clockid_t clock, const struct timespec *abstime);
 int htll_mutex_unlock(htll_mutex_t *impl, htll_context_t *me);
 int htll_mutex_destroy(htll_mutex_t *lock);
+void htll_mutex_bind(htll_mutex_t *impl, void *addr, const void *site);
 int htll_cond_init(upmutex_cond1_t *cond, const pthread_condattr_t *attr);
 int htll_cond_timedwait(upmutex_cond1_t *cond, htll_mutex_t *lock,
                         htll_context_t *me, const struct timespec *ts);
@@ -146,6 +345,24 @@ int upmutex_cond1_signal(upmutex_cond1_t *c);
 int upmutex_cond1_broadcast(upmutex_cond1_t *c);
 int upmutex_cond1_wait(upmutex_cond1_t *c, htll_mutex_t *m, htll_context_t *me);
 int upmutex_cond1_signal(upmutex_cond1_t *c);
+#if SUPPORT_RWLOCK
+htll_rwlock_t *htll_rwlock_create(const pthread_rwlockattr_t *attr);
+int htll_rwlock_rdlock(htll_rwlock_t *rw, htll_context_t *me);
+int htll_rwlock_wrlock(htll_rwlock_t *rw, htll_context_t *me);
+int htll_rwlock_timedrdlock(htll_rwlock_t *rw, htll_context_t *me,
+                            clockid_t clock, const struct timespec *abstime);
+int htll_rwlock_timedwrlock(htll_rwlock_t *rw, htll_context_t *me,
+                            clockid_t clock, const struct timespec *abstime);
+int htll_rwlock_tryrdlock(htll_rwlock_t *rw, htll_context_t *me);
+int htll_rwlock_trywrlock(htll_rwlock_t *rw, htll_context_t *me);
+int htll_rwlock_unlock(htll_rwlock_t *rw, htll_context_t *me);
+int htll_rwlock_destroy(htll_rwlock_t *rw);
+#endif
+int htll_spin_init(htll_spinlock_t *l, int pshared);
+int htll_spin_lock(htll_spinlock_t *l);
+int htll_spin_trylock(htll_spinlock_t *l);
+int htll_spin_unlock(htll_spinlock_t *l);
+int htll_spin_destroy(htll_spinlock_t *l);
 void htll_thread_start(void);
 void htll_thread_exit(void);
 void htll_application_init(void);
@@ -154,12 +371,20 @@ void htll_application_exit(void);
 typedef htll_mutex_t lock_mutex_t;
 typedef htll_context_t lock_context_t;
 typedef upmutex_cond1_t lock_cond_t;
+typedef htll_thread_t lock_thread_t;
+#if SUPPORT_RWLOCK
+typedef htll_rwlock_t lock_rwlock_t;
+#endif
+typedef htll_spinlock_t lock_spinlock_t;
 
 #define lock_mutex_create htll_mutex_create
 #define lock_mutex_lock htll_mutex_lock
+#define lock_mutex_lock_hint htll_mutex_lock_expect
 #define lock_mutex_trylock htll_mutex_trylock
+#define lock_mutex_timedlock htll_mutex_timedlock
 #define lock_mutex_unlock htll_mutex_unlock
 #define lock_mutex_destroy htll_mutex_destroy
+#define lock_mutex_bind htll_mutex_bind
 #define lock_cond_init upmutex_cond1_init
 #define lock_cond_timedwait htll_cond_timedwait
 #define lock_cond_wait upmutex_cond1_wait
@@ -171,5 +396,21 @@ typedef upmutex_cond1_t lock_cond_t;
 #define lock_application_init htll_application_init
 #define lock_application_exit htll_application_exit
 #define lock_init_context htll_init_context
+#if SUPPORT_RWLOCK
+#define lock_rwlock_create htll_rwlock_create
+#define lock_rwlock_rdlock htll_rwlock_rdlock
+#define lock_rwlock_wrlock htll_rwlock_wrlock
+#define lock_rwlock_timedrdlock htll_rwlock_timedrdlock
+#define lock_rwlock_timedwrlock htll_rwlock_timedwrlock
+#define lock_rwlock_tryrdlock htll_rwlock_tryrdlock
+#define lock_rwlock_trywrlock htll_rwlock_trywrlock
+#define lock_rwlock_unlock htll_rwlock_unlock
+#define lock_rwlock_destroy htll_rwlock_destroy
+#endif
+#define lock_spin_init htll_spin_init
+#define lock_spin_lock htll_spin_lock
+#define lock_spin_trylock htll_spin_trylock
+#define lock_spin_unlock htll_spin_unlock
+#define lock_spin_destroy htll_spin_destroy
 #define PTHREAD_COND_INITIALIZER UPMUTEX_COND1_INITIALIZER
 #endif // __htll_H__
@@ -1,6 +1,34 @@
 #pragma once
+#include <pthread.h>
 #include <stdint.h>
 
+/* HTLL_STATE_FILE=path keeps what the library learned (segment windows, hold
+ * times of the statically allocated locks) from one run to the next: loaded
+ * at startup, saved at exit, and every HTLL_STATE_PERIOD seconds if set */
+
+/* Ids from 0 to 255 are left to the application, others come from
+ * segment_register: -EINVAL for one it has not handed out */
 int segment_start(int segment_id);
+/* required_latency: latency target of the segment, in nanoseconds */
 int segment_end(int segment_id, uint64_t required_latency);
+/* Start a segment that must end by deadline (CLOCK_MONOTONIC, in ns), e.g.
+ * a request that already spent part of its budget in queues. The locks wait
+ * no longer than the slack left, and segment_end ignores required_latency */
+int segment_start_deadline(int segment_id, uint64_t deadline);
+/* Deadline of the innermost segment of the calling thread (CLOCK_MONOTONIC,
+ * in ns), 0 if none: hand it to segment_start_deadline on another thread to
+ * carry a request over */
+uint64_t segment_deadline(void);
+/* Id of the segment called name, registered on the first call for it. Safe
+ * to call from any thread; a negative errno once the ids are exhausted */
+int segment_register(const char *name);
+/* Steer the reorder window of the segment so that the given percentile of
+ * its durations (e.g. 99.9) stays under latency nanoseconds, instead of
+ * reacting to every segment_end. Applies to all threads and overrides the
+ * required_latency of segment_end; a latency of 0 removes the SLO */
+int segment_set_slo(int segment_id, uint64_t latency, double percentile);
+
 
+/* pthread_mutex_lock, telling waiters that the critical section should last
+ * about expected_cs_ns nanoseconds */
+int htll_mutex_lock_hint(pthread_mutex_t *mutex, uint64_t expected_cs_ns);
@@ -0,0 +1,76 @@
+#ifndef __MCS_H__
+#define __MCS_H__
+
+#include "padding.h"
+#define LOCK_ALGORITHM "MCS"
+#define NEED_CONTEXT 1
+#define SUPPORT_WAITING 1
+
+/**
+ * MCS queue lock: each waiter waits on the spin field of its own node, with
+ * the generic waiting policy of the library (e.g. mcs_adaptive).
+ **/
+typedef struct mcs_node {
+    struct mcs_node *volatile next;
+    char __pad[pad_to_cache_line(sizeof(struct mcs_node *))];
+    volatile int spin __attribute__((aligned(L_CACHE_LINE_SIZE)));
+} mcs_node_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+typedef struct mcs_mutex {
+    struct mcs_node *volatile tail __attribute__((aligned(L_CACHE_LINE_SIZE)));
+} mcs_mutex_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+// Fits in pthread_cond_t: a sequence number to wait on
+typedef struct mcs_cond {
+    volatile int seq;
+} mcs_cond_t;
+typedef char mcs_thread_t; // No per-thread state
+
+mcs_mutex_t *mcs_mutex_create(const pthread_mutexattr_t *attr);
+int mcs_mutex_lock(mcs_mutex_t *impl, mcs_node_t *me);
+int mcs_mutex_trylock(mcs_mutex_t *impl, mcs_node_t *me);
+// A queued waiter cannot leave the queue before its turn, so timedlock
+// never queues: it retries trylock until the deadline. It only gets the
+// lock when the queue happens to be empty, and starves behind queued
+// waiters under steady contention
+int mcs_mutex_timedlock(mcs_mutex_t *impl, mcs_node_t *me, clockid_t clock,
+                        const struct timespec *abstime);
+void mcs_mutex_unlock(mcs_mutex_t *impl, mcs_node_t *me);
+int mcs_mutex_destroy(mcs_mutex_t *lock);
+int mcs_cond_init(mcs_cond_t *cond, const pthread_condattr_t *attr);
+int mcs_cond_timedwait(mcs_cond_t *cond, mcs_mutex_t *lock, mcs_node_t *me,
+                       const struct timespec *ts);
+int mcs_cond_wait(mcs_cond_t *cond, mcs_mutex_t *lock, mcs_node_t *me);
+int mcs_cond_signal(mcs_cond_t *cond);
+int mcs_cond_broadcast(mcs_cond_t *cond);
+int mcs_cond_destroy(mcs_cond_t *cond);
+void mcs_thread_start(void);
+void mcs_thread_exit(void);
+void mcs_application_init(void);
+void mcs_application_exit(void);
+void mcs_init_context(mcs_mutex_t *impl, mcs_node_t *context, int number);
+
+typedef mcs_mutex_t lock_mutex_t;
+typedef mcs_node_t lock_context_t;
+typedef mcs_cond_t lock_cond_t;
+typedef mcs_thread_t lock_thread_t;
+
+#define lock_mutex_create mcs_mutex_create
+#define lock_mutex_lock mcs_mutex_lock
+#define lock_mutex_trylock mcs_mutex_trylock
+#define lock_mutex_timedlock mcs_mutex_timedlock
+#define lock_mutex_unlock mcs_mutex_unlock
+#define lock_mutex_destroy mcs_mutex_destroy
+#define lock_cond_init mcs_cond_init
+#define lock_cond_timedwait mcs_cond_timedwait
+#define lock_cond_wait mcs_cond_wait
+#define lock_cond_signal mcs_cond_signal
+#define lock_cond_broadcast mcs_cond_broadcast
+#define lock_cond_destroy mcs_cond_destroy
+#define lock_thread_start mcs_thread_start
+#define lock_thread_exit mcs_thread_exit
+#define lock_application_init mcs_application_init
+#define lock_application_exit mcs_application_exit
+#define lock_init_context mcs_init_context
+
+#endif // __MCS_H__
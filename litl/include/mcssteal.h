@@ -54,6 +54,7 @@ typedef struct mcssteal_mutex {
 } mcssteal_mutex_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
 
 typedef pthread_cond_t mcssteal_cond_t;
+typedef char mcssteal_thread_t; // No per-thread state
 mcssteal_mutex_t *mcssteal_mutex_create(const pthread_mutexattr_t *attr);
 int mcssteal_mutex_lock(mcssteal_mutex_t *impl, mcssteal_node_t *me);
 int mcssteal_mutex_trylock(mcssteal_mutex_t *impl, mcssteal_node_t *me);
@@ -75,6 +76,7 @@ void mcssteal_init_context(mcssteal_mutex_t *impl, mcssteal_node_t *context, int
 typedef mcssteal_mutex_t lock_mutex_t;
 typedef mcssteal_node_t lock_context_t;
 typedef mcssteal_cond_t lock_cond_t;
+typedef mcssteal_thread_t lock_thread_t;
 
 #define lock_mutex_create mcssteal_mutex_create
 #define lock_mutex_lock mcssteal_mutex_lock
@@ -40,6 +40,7 @@ typedef struct pthread_interpose_mutex {
 typedef pthread_cond_t pthread_interpose_cond_t;
 typedef void *pthread_interpose_context_t; // Unused, take the less space
                                            // as possible
+typedef char pthread_interpose_thread_t;   // No per-thread state
 
 pthread_interpose_mutex_t *
 pthread_interpose_mutex_create(const pthread_mutexattr_t *attr);
@@ -47,6 +48,10 @@ int pthread_interpose_mutex_lock(pthread_interpose_mutex_t *impl,
                                  pthread_interpose_context_t *me);
 int pthread_interpose_mutex_trylock(pthread_interpose_mutex_t *impl,
                                     pthread_interpose_context_t *me);
+int pthread_interpose_mutex_timedlock(pthread_interpose_mutex_t *impl,
+                                      pthread_interpose_context_t *me,
+                                      clockid_t clock,
+                                      const struct timespec *abstime);
 void pthread_interpose_mutex_unlock(pthread_interpose_mutex_t *impl,
                                     pthread_interpose_context_t *me);
 int pthread_interpose_mutex_destroy(pthread_interpose_mutex_t *lock);
@@ -70,10 +75,12 @@ void pthread_interpose_application_exit(void);
 typedef pthread_interpose_mutex_t lock_mutex_t;
 typedef pthread_interpose_context_t lock_context_t;
 typedef pthread_interpose_cond_t lock_cond_t;
+typedef pthread_interpose_thread_t lock_thread_t;
 
 #define lock_mutex_create pthread_interpose_mutex_create
 #define lock_mutex_lock pthread_interpose_mutex_lock
 #define lock_mutex_trylock pthread_interpose_mutex_trylock
+#define lock_mutex_timedlock pthread_interpose_mutex_timedlock
 #define lock_mutex_unlock pthread_interpose_mutex_unlock
 #define lock_mutex_destroy pthread_interpose_mutex_destroy
 #define lock_cond_init pthread_interpose_cond_init
@@ -13,7 +13,7 @@ UXNUM=$3
 echo -n "" > uxtail_tot
 echo -n "" > tail_cnt
 
-cur_len=4
+cur_len=3
 end_len=$[$cur_len+$RECORDLEN-1]
 ux_tot_line=0
 tot_line=0
@@ -88,7 +88,7 @@ awk '{sum += $1} END {printf "%3.3f\t",sum/NR}' uxtail_tot | tr '\n' '\t'  # avg
 sed -n "$p99_line p" uxtail_sorted | tr '\n' '\t' # p99
 sed -n "$p999_line p" uxtail_sorted | tr '\n' '\t' # p999
 sed -n "$tail_line p" uxtail_sorted | tr '\n' '\t' # p99
-sed -n "2 p" $FILE
+sed -n "1 p" $FILE
 
 rm -f tail_*
 rm uxtail_tot
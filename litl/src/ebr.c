@@ -0,0 +1,175 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "interpose.h"
+#include "ebr.h"
+
+extern unsigned int last_thread_id;
+
+// Number of pending objects that triggers a reclamation attempt
+#ifndef EBR_BATCH
+#define EBR_BATCH 64
+#endif
+
+struct ebr_node {
+	struct ebr_node *next;
+	void *ptr;
+	void (*free_fn)(void *);
+	uint64_t epoch;
+};
+
+typedef struct {
+	// 0 when outside of any section, (epoch << 1) | 1 otherwise
+	volatile uint64_t epoch;
+	unsigned int nesting;
+	unsigned int pending;
+	// Retired objects, oldest first
+	struct ebr_node *head;
+	struct ebr_node *tail;
+	char __pad[pad_to_cache_line(sizeof(uint64_t) + 2 * sizeof(unsigned int)
+				     + 2 * sizeof(struct ebr_node *))];
+} ebr_thread_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+static volatile uint64_t ebr_epoch __attribute__((aligned(L_CACHE_LINE_SIZE)))
+    = 1;
+static ebr_thread_t ebr_threads[MAX_THREADS];
+
+// Objects left behind by exited threads
+static volatile int ebr_orphans_lock;
+static struct ebr_node *ebr_orphans;
+
+void ebr_enter(void)
+{
+	ebr_thread_t *me = &ebr_threads[lp_thread()->id];
+
+	if (me->nesting++ == 0) {
+		uint64_t e = __atomic_load_n(&ebr_epoch, __ATOMIC_ACQUIRE);
+		// Full barrier: the announcement must be visible before any
+		// access to the protected objects
+		__atomic_exchange_n(&me->epoch, (e << 1) | 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void ebr_exit(void)
+{
+	ebr_thread_t *me = &ebr_threads[lp_thread()->id];
+
+	if (--me->nesting == 0)
+		__atomic_store_n(&me->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void ebr_try_advance(void)
+{
+	uint64_t e = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+	unsigned int n = __atomic_load_n(&last_thread_id, __ATOMIC_RELAXED);
+
+	if (n > MAX_THREADS)
+		n = MAX_THREADS;
+	for (unsigned int i = 0; i < n; i++) {
+		uint64_t local =
+		    __atomic_load_n(&ebr_threads[i].epoch, __ATOMIC_SEQ_CST);
+		if ((local & 1) && (local >> 1) != e)
+			return;
+	}
+	__sync_bool_compare_and_swap(&ebr_epoch, e, e + 1);
+}
+
+// Free the nodes of the list that are at least two epochs old, return the
+// others (the list is sorted by retirement epoch)
+static struct ebr_node *ebr_free_old(struct ebr_node *head,
+				     unsigned int *freed)
+{
+	uint64_t e = __atomic_load_n(&ebr_epoch, __ATOMIC_ACQUIRE);
+
+	while (head && head->epoch + 2 <= e) {
+		struct ebr_node *next = head->next;
+		head->free_fn(head->ptr);
+		free(head);
+		(*freed)++;
+		head = next;
+	}
+	return head;
+}
+
+static void ebr_reclaim_orphans(void)
+{
+	if (!ebr_orphans || __sync_lock_test_and_set(&ebr_orphans_lock, 1))
+		return;
+
+	unsigned int freed = 0;
+	ebr_orphans = ebr_free_old(ebr_orphans, &freed);
+	__sync_lock_release(&ebr_orphans_lock);
+}
+
+static void ebr_reclaim(ebr_thread_t * me)
+{
+	unsigned int freed = 0;
+
+	ebr_try_advance();
+	me->head = ebr_free_old(me->head, &freed);
+	if (!me->head)
+		me->tail = NULL;
+	me->pending -= freed;
+	ebr_reclaim_orphans();
+}
+
+void ebr_retire(void *ptr, void (*free_fn)(void *))
+{
+	ebr_thread_t *me = &ebr_threads[lp_thread()->id];
+	struct ebr_node *node = malloc(sizeof(struct ebr_node));
+
+	if (!node) {
+		fprintf(stderr, "Unable to retire %p (LitL)\n", ptr);
+		exit(-1);
+	}
+	node->next = NULL;
+	node->ptr = ptr;
+	node->free_fn = free_fn;
+	// Read after the object was unlinked
+	node->epoch = __atomic_load_n(&ebr_epoch, __ATOMIC_SEQ_CST);
+
+	if (me->tail)
+		me->tail->next = node;
+	else
+		me->head = node;
+	me->tail = node;
+
+	if (++me->pending >= EBR_BATCH)
+		ebr_reclaim(me);
+}
+
+void ebr_thread_exit(void)
+{
+	ebr_thread_t *me = &ebr_threads[lp_thread()->id];
+
+	if (me->head)
+		ebr_reclaim(me);
+	if (!me->head)
+		return;
+
+	// Hand the rest over, merged so that the orphan list stays sorted
+	while (__sync_lock_test_and_set(&ebr_orphans_lock, 1))
+		CPU_PAUSE();
+	struct ebr_node **pos = &ebr_orphans;
+	struct ebr_node *cur = me->head;
+	while (cur) {
+		while (*pos && (*pos)->epoch <= cur->epoch)
+			pos = &(*pos)->next;
+		struct ebr_node *next = cur->next;
+		cur->next = *pos;
+		*pos = cur;
+		pos = &cur->next;
+		cur = next;
+	}
+	__sync_lock_release(&ebr_orphans_lock);
+
+	me->head = me->tail = NULL;
+	me->pending = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef __EBR_H__
+#define __EBR_H__
+
+/*
+ * Epoch-based memory reclamation for the lock objects and the lock table.
+ *
+ * A thread that may touch an object after it could have been unlinked (a
+ * table lookup, the tail of an unlock that already released the lock word)
+ * brackets the accesses with ebr_enter/ebr_exit. ebr_retire defers the
+ * release of an unlinked object until every thread that was inside such a
+ * section when it was retired has left it. Sections nest and are cheap
+ * outside of them: an idle thread never delays reclamation.
+ */
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(void *ptr, void (*free_fn)(void *));
+void ebr_thread_exit(void);
+
+#endif // __EBR_H__
@@ -1,13 +1,19 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <asm-generic/errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <linux/futex.h>
 #include <unistd.h>
 #include <sys/syscall.h>
@@ -16,146 +22,855 @@
 #include <pthread.h>
 #include <malloc.h>
 #include <limits.h>
+#include <link.h>
+#include <signal.h>
 #include <htll.h>
 #include <libhtll.h>
 #include <sched.h>
 #include "interpose.h"
 #include "utils.h"
+#include "ebr.h"
+#include "slab.h"
+#include "timebase.h"
 
-
-extern __thread unsigned int cur_thread_id;
+/* Ids below MAX_SEGMENT are picked by the application, segment_register
+ * hands out the next ones, up to HTLL_SEGMENT_MAX */
 #define MAX_SEGMENT 256
+#define HTLL_SEGMENT_MAX (1 << 14)
+/* Segments are allocated by pages, per thread and in the registry */
+#define HTLL_SEGMENT_PAGE 64
+#define HTLL_SEGMENT_PAGES (HTLL_SEGMENT_MAX / HTLL_SEGMENT_PAGE)
 
-typedef struct {
+/* Process-wide part of a segment */
+typedef struct htll_segment_info {
+  /* Given to segment_register, NULL for the ids of the application */
+  const char *name;
+  /* Latency SLO: latency in ns (0 for none), percentile in hundredths of a
+   * percent */
+  uint64_t slo_latency;
+  unsigned int slo_percentile;
+  /* Reorder window learned by all threads (0 until the first fold), where a
+   * thread starts from. Apart from the SLO, read on every segment_end */
+  struct {
+    uint64_t wait_time;
+    uint64_t unit;
+  } model __attribute__((aligned(CACHE_LINE_SIZE)));
+} segment_info_t;
+
+static segment_info_t *htll_segment_info[HTLL_SEGMENT_PAGES];
+/* Open addressing on the registered names: id + 1, 0 for a free slot */
+static int htll_segment_names[2 * HTLL_SEGMENT_MAX];
+static int htll_segment_next = MAX_SEGMENT;
+
+typedef struct htll_segment {
   uint64_t wait_time;
   uint64_t unit;
   uint64_t has_waiter;
   uint64_t start_ts;
   uint64_t quick_start;
+  /* Latency target given to the last segment_end, in ns (0 before), or
+   * the budget left at the start for segments with a deadline */
+  uint64_t latency;
+  /* In ticks, 0 unless started by segment_start_deadline */
+  uint64_t deadline;
+  /* Durations since the last evaluation, allocated once there is an SLO */
+  uint32_t *hist;
+  uint32_t samples;
+  uint32_t ends;
+  segment_info_t *info;
 } segment_t;
 
-__thread segment_t segment[MAX_SEGMENT] = {0};
+static inline htll_thread_t *htll_self(void) { return &lp_thread()->lock; }
+
+static inline uint64_t htll_getticks(void) { return timebase_ticks(); }
+
+#define HTLL_FOR_N_CYCLES(n, do)                                               \
+  {                                                                            \
+    uint64_t ___s = htll_getticks();                                           \
+    while (1) {                                                                \
+      do                                                                       \
+        ;                                                                      \
+      uint64_t ___e = htll_getticks();                                         \
+      if ((___e - ___s) > n) {                                                 \
+        break;                                                                 \
+      }                                                                        \
+    }                                                                          \
+  }
+
+/* The durations of htll.h in ticks, set by htll_application_init once the
+ * time base is calibrated (ticks are nanoseconds until then) */
+static struct {
+  uint64_t spin_lock;
+  uint64_t spin_spinlock;
+  uint64_t unlock_delay;
+  uint64_t spin_min;
+  uint64_t spin_max;
+  uint64_t park_cost;
+  uint64_t yield_max;
+  uint64_t wait_yield;
+  uint64_t wait_spin;
+  uint64_t starve;
+  uint64_t critical;
+} htll_ticks = {HTLL_SPIN_LOCK_NS,  HTLL_SPIN_SPINLOCK_NS, HTLL_UNLOCK_DELAY_NS,
+                HTLL_SPIN_MIN_NS,   HTLL_SPIN_MAX_NS,      HTLL_PARK_COST_NS,
+                HTLL_YIELD_MAX_NS,  HTLL_WAIT_YIELD_NS,    HTLL_WAIT_SPIN_NS,
+                HTLL_STARVE_NS,     HTLL_CRITICAL_LATENCY_NS};
+
+/* Futex bitsets of the threads sleeping on a lock word: one per class
+ * (bit class), and the starving waiter, only woken by a handoff */
+#define HTLL_FUTEX_CLASS(c) (1U << (c))
+#define HTLL_FUTEX_STARVING (1U << HTLL_CLASSES)
+
+#if HTLL_STATS
+/* Reorder windows that ran to their end, and by how much they overran */
+static struct {
+  uint64_t expired;
+  uint64_t acquired;
+  uint64_t overshoot;
+  uint64_t overshoot_max;
+} htll_stats;
+#endif
+
+static inline void htll_delay(uint64_t ticks) {
+  uint64_t start = htll_getticks();
+  while (htll_getticks() - start < ticks)
+    ;
+}
+
+/* Relative futex timeout (tv_nsec must stay below one second) */
+static inline struct timespec htll_reltime(uint64_t ns) {
+  return (struct timespec){ns / 1000000000ULL, ns % 1000000000ULL};
+}
+
+/* Absolute futex timeout, ns after now */
+static inline struct timespec htll_abstime(const struct timespec *now,
+                                           uint64_t ns) {
+  uint64_t nsec = now->tv_nsec + ns;
+  return (struct timespec){now->tv_sec + nsec / 1000000000ULL,
+                           nsec % 1000000000ULL};
+}
+
+/* The segment the calling thread is in, NULL outside of segments */
+static inline segment_t *cur_segment(htll_thread_t *t) {
+  return t->cur_segment;
+}
+
+/* Reorder window of seg from now, in ns: cut down to the slack left before
+ * its deadline, if any, and to a last spin once the deadline has passed */
+static inline uint64_t segment_window(segment_t *seg) {
+  if (!seg->deadline)
+    return seg->wait_time;
+  uint64_t now = htll_getticks();
+  uint64_t slack =
+      seg->deadline > now ? timebase_ticks_to_ns(seg->deadline - now) : 0;
+  if (slack < HTLL_WAIT_SPIN_NS)
+    return HTLL_WAIT_SPIN_NS;
+  return slack < seg->wait_time ? slack : seg->wait_time;
+}
 
-__thread int cur_segment_id = -1;
+#define __htll_unlikely(x) __builtin_expect((x), 0)
 
 static inline int sys_futex(void *addr1, int op, int val1,
                             struct timespec *timeout, void *addr2, int val3) {
   return syscall(SYS_futex, addr1, op, val1, timeout, addr2, val3);
 }
 
+static const char *htll_state_path;
+static void htll_state_bind(htll_state_t *s, void *addr, const void *site);
+static void htll_state_unbind(htll_state_t *s);
+static void htll_state_load(void);
+static void htll_state_save(void);
+
+static void htll_state_init(htll_state_t *s) {
+  s->hold = 0;
+  s->gap = 0;
+  s->released_at = 0;
+  s->spinners = 0;
+  s->site = 0;
+  for (int c = 0; c < HTLL_CLASSES; c++)
+    s->parked[c] = 0;
+#if HTLL_EDF
+  s->qlock = 0;
+  s->waiters = NULL;
+#endif
+}
+
+#if NO_INDIRECTION
+static slab_t htll_state_slab =
+    SLAB_INITIALIZER(sizeof(htll_state_t), L_CACHE_LINE_SIZE);
+
+static void htll_state_free(void *s) { slab_free(&htll_state_slab, s); }
+
+static htll_state_t *htll_state_alloc(htll_mutex_t *m, const void *site) {
+  htll_state_t *s = (htll_state_t *)slab_alloc(&htll_state_slab);
+  htll_state_init(s);
+  htll_state_t *expected = NULL;
+  if (!__atomic_compare_exchange_n(&m->state, &expected, s, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    htll_state_free(s);
+    return expected;
+  }
+  htll_state_bind(s, m, site);
+  return s;
+}
+
+static inline htll_state_t *htll_state(htll_mutex_t *m) {
+  htll_state_t *s = __atomic_load_n(&m->state, __ATOMIC_ACQUIRE);
+  if (__builtin_expect(s == NULL, 0))
+    s = htll_state_alloc(m, NULL);
+  return s;
+}
+#else
+static slab_t htll_mutex_slab =
+    SLAB_INITIALIZER(sizeof(htll_mutex_t), L_CACHE_LINE_SIZE);
+
+static inline htll_state_t *htll_state(htll_mutex_t *m) { return &m->state; }
+#endif
+
 htll_mutex_t *htll_mutex_create(const pthread_mutexattr_t *attr) {
+#if NO_INDIRECTION
   htll_mutex_t *impl = (htll_mutex_t *)alloc_cache_align(sizeof(htll_mutex_t));
   impl->l.u = 0;
-  impl->ticks_spin = HTLL_SPIN_TRIES_LOCK;
-  impl->cnt_unlock = 0;
-  impl->cnt_wake = 0;
-  impl->flag = 0;
+  impl->sleepers = 0;
+  impl->state = NULL;
+  impl->acquired_at = 0;
+  impl->hint = 0;
+  impl->starving = 0;
+#else
+  htll_mutex_t *impl = (htll_mutex_t *)slab_alloc(&htll_mutex_slab);
+  impl->l.u = 0;
+  impl->sleepers = 0;
+  impl->hint = 0;
+  impl->starving = 0;
+  htll_state_init(&impl->state);
+#endif
   return impl;
 }
 
 int htll_mutex_destroy(htll_mutex_t *m) {
-  /* Do nothing */
-  (void)m;
+#if NO_INDIRECTION
+  /* Back to the all-zeros state; a late unlocker may still use the state */
+  if (m->state) {
+    htll_state_unbind(m->state);
+    ebr_retire(m->state, htll_state_free);
+  }
+  m->state = NULL;
+  m->sleepers = 0;
+  m->hint = 0;
+  m->starving = 0;
+  m->l.u = 0;
+#else
+  /* The interpose layer retires the lock, nobody can reach it anymore */
+  htll_state_unbind(&m->state);
+  slab_free(&htll_mutex_slab, m);
+#endif
   return 0;
 }
 
-int htll_mutex_lock(htll_mutex_t *m, htll_context_t *me) {
-  int spin_ticks = m->ticks_spin;
-  int sleep_time = segment[cur_segment_id].wait_time;
-  int flag = (cur_segment_id == -1 ? 1 : 0);
+void htll_mutex_bind(htll_mutex_t *m, void *addr, const void *site) {
+#if NO_INDIRECTION
+  /* The state is otherwise allocated on the first contention, when the site
+   * is no longer known */
+  (void)addr;
+  if (htll_state_path && !m->state)
+    htll_state_alloc(m, site);
+#else
+  htll_state_bind(&m->state, addr, site);
+#endif
+}
+
+/* Test and test-and-set for at most ticks cycles: the line is only taken
+ * exclusive when the lock looks free. Between attempts, back off with PAUSE,
+ * doubling up to a cap proportional to the number of spinners so that they do
+ * not all rush the line when it is released. Returns 1 once acquired */
+static inline int htll_spin(volatile uint8_t *locked, uint64_t ticks,
+                            unsigned spinners) {
+  unsigned cap = HTLL_BACKOFF_UNIT * (spinners ? spinners : 1);
+  if (cap > HTLL_BACKOFF_MAX)
+    cap = HTLL_BACKOFF_MAX;
+  unsigned backoff = 1;
+  uint64_t start = htll_getticks();
+  do {
+    if (!*locked && !htll_swap_uint8(locked, LOCKED))
+      return 1;
+    for (unsigned i = 0; i < backoff; i++)
+      htll_pause();
+    backoff = backoff * 2 > cap ? cap : backoff * 2;
+  } while (htll_getticks() - start <= ticks);
+  return 0;
+}
+
+static inline int htll_mutex_spin(htll_mutex_t *m, htll_state_t *s,
+                                  uint64_t ticks) {
+  unsigned n = __atomic_add_fetch(&s->spinners, 1, __ATOMIC_RELAXED);
+  int got = htll_spin(&m->l.b.locked, ticks, n);
+  __atomic_sub_fetch(&s->spinners, 1, __ATOMIC_RELAXED);
+  return got;
+}
+
+/* Fold a sample into a running average, the first one is taken as is */
+static inline void htll_ewma(uint64_t *avg, uint64_t sample) {
+  if (*avg == 0)
+    *avg = sample;
+  else
+    *avg += ((int64_t)sample - (int64_t)*avg) >> HTLL_EWMA_SHIFT;
+}
+
+/* Called by the new owner of the lock */
+static inline void htll_acquired(htll_mutex_t *m, uint64_t hint) {
+  m->acquired_at = htll_getticks();
+  m->hint = hint;
+}
+
+/* Same, without waiting: no clock read, the first waiter stamps the hold
+ * instead (htll_owner_seen) */
+static inline void htll_acquired_fast(htll_mutex_t *m, uint64_t hint) {
+  m->acquired_at = 0;
+  m->hint = hint;
+}
+
+/* The owner took the lock without a stamp: start its hold from now */
+static inline void htll_owner_seen(htll_mutex_t *m) {
+  uint64_t unknown = 0;
+  if (!m->acquired_at)
+    __atomic_compare_exchange_n(&m->acquired_at, &unknown, htll_getticks(), 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Same, after waiting: also samples the handoff gap */
+static inline void htll_handoff(htll_mutex_t *m, htll_state_t *s,
+                                uint64_t hint) {
+  htll_acquired(m, hint);
+  uint64_t gap = m->acquired_at - s->released_at;
+  htll_ewma(&s->gap, gap < htll_ticks.yield_max ? gap : htll_ticks.yield_max);
+}
+
+/* Expected time before a waiter gets the lock, 0 while nothing is known */
+static inline uint64_t htll_expected_wait(htll_mutex_t *m, htll_state_t *s) {
+  uint64_t hold = m->hint ? m->hint : s->hold;
+  if (hold == 0)
+    return 0;
+  uint64_t at = m->acquired_at;
+  uint64_t elapsed = at ? htll_getticks() - at : 0;
+  /* An owner past its usual hold time may need as long again */
+  uint64_t remaining = elapsed < hold ? hold - elapsed : hold;
+  return remaining + s->gap;
+}
+
+/* Give the CPU away until the lock is taken or ticks have elapsed */
+static int htll_mutex_yield(htll_mutex_t *m, uint64_t ticks) {
+  uint64_t start = htll_getticks();
+  do {
+    sched_yield();
+    if (!m->l.b.locked && !htll_swap_uint8(&m->l.b.locked, LOCKED))
+      return 1;
+  } while (htll_getticks() - start <= ticks);
+  return 0;
+}
+
+/* Wait for the lock without sleeping if it should come soon: spin on short
+ * waits, yield on medium ones, spinning at least min_ticks. Returns 1 once
+ * acquired, 0 if the caller should park */
+static int htll_mutex_wait_briefly(htll_mutex_t *m, htll_state_t *s,
+                                   uint64_t min_ticks) {
+  /* Have the owner sample its hold time */
+  m->l.b.contended = 1;
+  htll_owner_seen(m);
+  uint64_t wait = htll_expected_wait(m, s);
+  uint64_t ticks = 0;
+  if (wait == 0) {
+    ticks = htll_ticks.spin_lock;
+  } else if (wait <= htll_ticks.park_cost) {
+    ticks = 2 * wait;
+    if (ticks < htll_ticks.spin_min)
+      ticks = htll_ticks.spin_min;
+    if (ticks > htll_ticks.spin_max)
+      ticks = htll_ticks.spin_max;
+  } else if (wait <= htll_ticks.yield_max) {
+    if (htll_mutex_yield(m, 2 * wait))
+      return 1;
+  }
+  if (ticks < min_ticks)
+    ticks = min_ticks;
+  return ticks && htll_mutex_spin(m, s, ticks);
+}
+
+/* Latency class of the current thread, from its innermost segment */
+static inline int htll_class(segment_t *seg) {
+  if (!seg)
+    return HTLL_CLASS_BACKGROUND;
+  /* Until its first end, the target of a segment is unknown */
+  if (seg->deadline) {
+    uint64_t now = htll_getticks();
+    return seg->deadline <= now + htll_ticks.critical ? HTLL_CLASS_CRITICAL
+                                                      : HTLL_CLASS_LOOSE;
+  }
+  if (seg->latency && seg->latency <= HTLL_CRITICAL_LATENCY_NS)
+    return HTLL_CLASS_CRITICAL;
+  return HTLL_CLASS_LOOSE;
+}
+
+/* Sleep on the lock word once, for at most timeout. Returns 1 if the lock was
+ * taken instead, ETIMEDOUT if the timeout expired, 0 otherwise */
+static int htll_mutex_park(htll_mutex_t *m, int op, struct timespec *timeout) {
+  int c = htll_class(cur_segment(htll_self()));
+  unsigned int *parked = &htll_state(m)->parked[c];
+  __atomic_add_fetch(parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
+  /* Counted first: an unlock that did not see us has already released, or
+   * finds HTLL_SLEEPING in the word it releases. The word is or-ed rather
+   * than swapped, not to lose HTLL_GRANTED */
+  uint32_t old = __atomic_fetch_or(
+      &m->l.u, LOCKED_AND_CONTENDED | HTLL_SLEEPING, __ATOMIC_SEQ_CST);
+  if ((old & LOCKED) == UNLOCKED) {
+    __atomic_sub_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(parked, 1, __ATOMIC_SEQ_CST);
+    return 1;
+  }
+  int ret =
+      sys_futex(m, op, old | LOCKED_AND_CONTENDED | HTLL_SLEEPING, timeout,
+                NULL, HTLL_FUTEX_CLASS(c));
+  int err = errno;
+  /* We still want the lock, so it is alive: the waker never writes to it */
+  __atomic_sub_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(parked, 1, __ATOMIC_SEQ_CST);
+  return ret == -1 && err == ETIMEDOUT ? ETIMEDOUT : 0;
+}
+
+/* Wake one sleeper, from the most urgent class that has one. The lock is
+ * released already: s was read before, only the futex touches m */
+static inline void htll_mutex_wake(htll_mutex_t *m, htll_state_t *s) {
+  for (int c = 0; s && c < HTLL_CLASSES; c++) {
+    if (s->parked[c] &&
+        sys_futex(m, FUTEX_WAKE_BITSET_PRIVATE, 1, NULL, NULL,
+                  HTLL_FUTEX_CLASS(c)) > 0)
+      return;
+  }
+  /* The starving waiter, or a sleeper the counts missed */
+  sys_futex(m, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Become the starving waiter, and sleep until the lock is handed over (or
+ * found free). Returns 0 if another waiter already is */
+static int htll_mutex_starve(htll_mutex_t *m) {
+  unsigned int idle = 0;
+  if (!__atomic_compare_exchange_n(&m->starving, &idle, 1, 0, __ATOMIC_SEQ_CST,
+                                   __ATOMIC_RELAXED))
+    return 0;
+
+  /* Counted as a sleeper, so that unlock takes its slow path */
+  __atomic_add_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
   while (1) {
-    if (!htll_swap_uint8(&m->l.b.locked, LOCKED)) {
-      return 0;
+    uint32_t old = __atomic_fetch_or(
+        &m->l.u, LOCKED_AND_CONTENDED | HTLL_SLEEPING, __ATOMIC_SEQ_CST);
+    if ((old & LOCKED) == UNLOCKED)
+      break;
+    if (old & HTLL_GRANTED) {
+      __atomic_fetch_and(&m->l.u, ~HTLL_GRANTED, __ATOMIC_SEQ_CST);
+      break;
     }
+    sys_futex(m, FUTEX_WAIT_BITSET_PRIVATE,
+              old | LOCKED_AND_CONTENDED | HTLL_SLEEPING, NULL, NULL,
+              HTLL_FUTEX_STARVING);
+  }
+  __atomic_store_n(&m->starving, 0, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
 
-    HTLL_FOR_N_CYCLES(
-        spin_ticks,
-        if (!htll_swap_uint8(&m->l.b.locked, LOCKED)) { return 0; });
+#if HTLL_EDF
+static inline void htll_edf_qlock(htll_state_t *s) {
+  while (__sync_lock_test_and_set(&s->qlock, 1))
+    while (s->qlock)
+      htll_pause();
+}
 
-    /* Have to sleep */
-    if ((htll_swap_uint32(&m->l.u, LOCKED_AND_CONTENDED) & LOCKED) ==
-        UNLOCKED) {
-      return 0;
+static inline void htll_edf_qunlock(htll_state_t *s) {
+  __sync_lock_release(&s->qlock);
+}
+
+static inline uint64_t htll_edf_deadline(segment_t *seg, uint64_t arrival) {
+  if (seg && seg->deadline)
+    return seg->deadline;
+  if (seg && seg->latency)
+    return seg->start_ts + timebase_ns_to_ticks(seg->latency);
+  return arrival + htll_ticks.starve;
+}
+
+/* Called by the owner: hand the lock over to the earliest deadline, or
+ * release it if nobody is queued */
+static void htll_edf_release(htll_mutex_t *m) {
+  htll_state_t *s = htll_state(m);
+  htll_edf_qlock(s);
+  htll_waiter_t *w = s->waiters;
+  if (w)
+    s->waiters = w->next;
+  else
+    htll_swap_uint32(&m->l.u, UNLOCKED);
+  htll_edf_qunlock(s);
+  /* The lock now belongs to w, only w is touched from here on */
+  if (w) {
+    __atomic_store_n(&w->granted, 1, __ATOMIC_SEQ_CST);
+    sys_futex((void *)&w->granted, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/*
+ * Queue up by deadline and sleep until the lock is handed over. The lock is
+ * tried once queued: an owner that released it before we were queued did not
+ * see us. Returns ETIMEDOUT if abstime (if any) expired first.
+ */
+static int htll_edf_wait(htll_mutex_t *m, uint64_t deadline, int op,
+                         const struct timespec *abstime) {
+  htll_state_t *s = htll_state(m);
+  htll_waiter_t *w = &htll_self()->waiter;
+  w->deadline = deadline;
+  w->granted = 0;
+  /* Have the unlocks take their slow path */
+  __atomic_add_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
+
+  htll_edf_qlock(s);
+  htll_waiter_t **pos = &s->waiters;
+  while (*pos && (*pos)->deadline <= deadline)
+    pos = &(*pos)->next;
+  w->next = *pos;
+  *pos = w;
+  htll_edf_qunlock(s);
+
+  /* Once queued, mark the word: an unlock that releases it anyway saw no
+   * mark, and the lock is then free for us to take */
+  int ret = 0;
+  uint32_t old =
+      __atomic_fetch_or(&m->l.u, LOCKED | HTLL_SLEEPING, __ATOMIC_SEQ_CST);
+  if ((old & LOCKED) == UNLOCKED) {
+    /* Nobody can hand us the lock while we hold it */
+    htll_edf_qlock(s);
+    for (pos = &s->waiters; *pos != w; pos = &(*pos)->next)
+      ;
+    *pos = w->next;
+    htll_edf_qunlock(s);
+    goto out;
+  }
+
+  while (!w->granted) {
+    if (sys_futex((void *)&w->granted, op, 0, (struct timespec *)abstime,
+                  NULL, FUTEX_BITSET_MATCH_ANY) == -1 &&
+        errno == ETIMEDOUT) {
+      htll_edf_qlock(s);
+      for (pos = &s->waiters; *pos && *pos != w; pos = &(*pos)->next)
+        ;
+      if (*pos) {
+        *pos = w->next;
+        ret = ETIMEDOUT;
+      }
+      htll_edf_qunlock(s);
+      if (ret)
+        goto out;
+      /* Already dequeued: the lock is on its way */
+      abstime = NULL;
     }
+  }
+out:
+  __atomic_sub_fetch(&m->sleepers, 1, __ATOMIC_SEQ_CST);
+  return ret;
+}
+#endif
+
+/* Sleep until the lock is ours, outside of segments. A waiter overtaken too
+ * many times, or for too long, asks for the lock to be handed over. Unlock
+ * wakes the segment classes first, so the park has a deadline: the age
+ * bound holds even if this waiter is never woken */
+static void htll_mutex_sleep(htll_mutex_t *m, uint64_t start) {
+  unsigned int woken = 0;
+  uint64_t waited = timebase_ticks_to_ns(htll_getticks() - start);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  struct timespec bound = htll_abstime(
+      &now, waited < HTLL_STARVE_NS ? HTLL_STARVE_NS - waited : 0);
+  while (1) {
+    int ret = htll_mutex_park(m, FUTEX_WAIT_BITSET_PRIVATE, &bound);
+    if (ret == 1)
+      return;
+    /* Woken without the lock: a barging thread took it first. The deadline
+     * covers waiters that are never woken, this count the ones woken in vain */
+    if ((ret == ETIMEDOUT || ++woken >= HTLL_BYPASS_MAX) &&
+        htll_mutex_starve(m))
+      return;
+    /* Another waiter is starving already: wait for a turn after it */
+    if (ret == ETIMEDOUT) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      bound = htll_abstime(&now, HTLL_STARVE_NS);
+    }
+  }
+}
 
-    if (flag == 0) {
-      sys_futex(m, FUTEX_WAIT_PRIVATE, 257,
-                (struct timespec[]){{0, segment[cur_segment_id].wait_time}},
-                NULL, 0);
+/*
+ * Wait for the lock during a reorder window of ns nanoseconds. The window has
+ * an absolute deadline, so wake-ups that do not hand us the lock do not
+ * restart it: park on the futex (CLOCK_MONOTONIC) until HTLL_WAIT_YIELD_NS
+ * before the end, where a sleep could overshoot by the timer slack and the
+ * wake-up latency, then yield, then spin. Returns 1 once acquired, 0 at the
+ * end of the window.
+ */
+static int htll_mutex_wait_for(htll_mutex_t *m, htll_state_t *s, uint64_t ns) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t deadline = htll_getticks() + timebase_ns_to_ticks(ns);
+  int got = 0;
 
-      segment[cur_segment_id].has_waiter = 1;
-      spin_ticks = spin_ticks * 2;
-    } else {
-      while (htll_swap_uint32(&m->l.u, 257) & 1) {
-        sys_futex(m, FUTEX_WAIT_PRIVATE, 257, NULL, NULL, 0);
+  if (ns > HTLL_WAIT_YIELD_NS) {
+    struct timespec park = htll_abstime(&now, ns - HTLL_WAIT_YIELD_NS);
+    while (htll_getticks() < deadline - htll_ticks.wait_yield) {
+      int ret = htll_mutex_park(m, FUTEX_WAIT_BITSET_PRIVATE, &park);
+      if (ret == 1) {
+        got = 1;
+        break;
       }
-      return 0;
+      if (ret == ETIMEDOUT)
+        break;
     }
   }
-  return 0;
+  while (!got) {
+    uint64_t t = htll_getticks();
+    if (t >= deadline)
+      break;
+    if (deadline - t <= htll_ticks.wait_spin) {
+      got = htll_mutex_spin(m, s, deadline - t);
+      break;
+    }
+    sched_yield();
+    got = !m->l.b.locked && !htll_swap_uint8(&m->l.b.locked, LOCKED);
+  }
+
+#if HTLL_STATS
+  if (got) {
+    __atomic_add_fetch(&htll_stats.acquired, 1, __ATOMIC_RELAXED);
+  } else {
+    uint64_t over = htll_getticks() - deadline;
+    uint64_t max = __atomic_load_n(&htll_stats.overshoot_max, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&htll_stats.expired, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&htll_stats.overshoot, over, __ATOMIC_RELAXED);
+    while (over > max &&
+           !__atomic_compare_exchange_n(&htll_stats.overshoot_max, &max, over,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+#endif
+  return got;
 }
 
-#define __htll_unlikely(x) __builtin_expect((x), 0)
-void adjust_spin_ticks(htll_mutex_t *m) {
+/* Get the lock back after a condition wait */
+static void htll_mutex_relock(htll_mutex_t *m) {
+  htll_state_t *s = htll_state(m);
+  segment_t *seg = cur_segment(htll_self());
+#if HTLL_EDF
+  htll_edf_wait(m, htll_edf_deadline(seg, htll_getticks()),
+                FUTEX_WAIT_BITSET_PRIVATE, NULL);
+#else
+  if (!seg) {
+    htll_mutex_sleep(m, htll_getticks());
+  } else {
+    while (!htll_mutex_wait_for(m, s, segment_window(seg)))
+      seg->has_waiter = 1;
+  }
+#endif
+  htll_handoff(m, s, 0);
+}
+
+static int htll_mutex_lock_slow(htll_mutex_t *m, uint64_t hint) {
+  uint64_t start = htll_getticks();
+  htll_state_t *s = htll_state(m);
+  uint64_t spin_ticks = 0;
+  segment_t *seg = cur_segment(htll_self());
+  while (1) {
+    if (htll_mutex_wait_briefly(m, s, spin_ticks))
+      break;
+
+#if HTLL_EDF
+    htll_edf_wait(m, htll_edf_deadline(seg, start), FUTEX_WAIT_BITSET_PRIVATE,
+                  NULL);
+    break;
+#else
+    /* Have to sleep */
+    if (seg) {
+      if (htll_mutex_wait_for(m, s, segment_window(seg)))
+        break;
+
+      seg->has_waiter = 1;
+      /* Spin longer before sleeping again */
+      spin_ticks = spin_ticks ? spin_ticks * 2 : htll_ticks.spin_min;
+      if (spin_ticks > htll_ticks.yield_max)
+        spin_ticks = htll_ticks.yield_max;
+    } else {
+      htll_mutex_sleep(m, start);
+      break;
+    }
+#endif
+  }
+  htll_handoff(m, s, hint);
+  return 0;
+}
 
-  if (m->cnt_wake > WAKE_MAX_THRESHOLD)
-    m->ticks_spin = m->ticks_spin + INCREASE_UNIT;
-  else if (m->cnt_wake < WAKE_MIN_THRESHOLD)
-    m->ticks_spin = m->ticks_spin - DECREASE_UNIT;
-  m->cnt_wake = 0;
+int htll_mutex_lock(htll_mutex_t *m, htll_context_t *me) {
+  if (!htll_swap_uint8(&m->l.b.locked, LOCKED)) {
+    htll_acquired_fast(m, 0);
+    return 0;
+  }
+  return htll_mutex_lock_slow(m, 0);
 }
 
-int htll_mutex_unlock(htll_mutex_t *m, htll_context_t *me) {
-  /* Locked and not contended */
-  if ((m->l.u == 1) && (__sync_val_compare_and_swap(&m->l.u, 1, 0) == 1)) {
+/* Lock with the expected length of the critical section, which waiters then
+ * use instead of the average hold time */
+int htll_mutex_lock_expect(htll_mutex_t *m, htll_context_t *me,
+                           uint64_t cs_ns) {
+  uint64_t hint = cs_ns ? timebase_ns_to_ticks(cs_ns) : 0;
+  /* 0 means no hint */
+  if (cs_ns && !hint)
+    hint = 1;
+  if (!htll_swap_uint8(&m->l.b.locked, LOCKED)) {
+    htll_acquired_fast(m, hint);
     return 0;
   }
+  return htll_mutex_lock_slow(m, hint);
+}
 
-  m->cnt_unlock++;
-  if (__htll_unlikely((m->cnt_unlock & ADJUST_THRESHOLD) == 0)) {
-    adjust_spin_ticks(m);
+int htll_mutex_unlock(htll_mutex_t *m, htll_context_t *me) {
+  /* Only holds that had waiters are sampled, still under the lock; from the
+   * arrival of the first waiter if the owner did not wait itself */
+  if (m->l.b.contended && m->acquired_at) {
+    htll_state_t *s = htll_state(m);
+    s->released_at = htll_getticks();
+    htll_ewma(&s->hold, s->released_at - m->acquired_at);
   }
 
-  /* Unlock */
-  m->l.b.locked = UNLOCKED;
-  asm volatile("mfence");
-  if (m->l.b.locked) {
+#if HTLL_EDF
+  /* Release only while nobody is queued, the word says so */
+  uint32_t w = m->l.u;
+  while (!(w & HTLL_SLEEPING))
+    if (__atomic_compare_exchange_n(&m->l.u, &w, UNLOCKED, 0, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_RELAXED))
+      return 0;
+  /* The state is touched again after the release */
+  ebr_enter();
+  htll_edf_release(m);
+  ebr_exit();
+  return 0;
+#endif
+
+#if NO_INDIRECTION
+  /* The lock is the memory of the application, which may free it as soon as
+   * it is released: as in lll_unlock, the word returned by the release tells
+   * whether to wake, and only the futex touches the address afterwards */
+  if (__builtin_expect(m->sleepers == 0, 1)) {
+    if (__builtin_expect(
+            !(htll_swap_uint32(&m->l.u, UNLOCKED) & HTLL_SLEEPING), 1))
+      return 0;
+    /* Somebody parked while we released: wake any class */
+    sys_futex(m, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    return 0;
+  }
+#else
+  /* The swap is a full barrier on x86: sleepers is read after the release */
+  if (__builtin_expect(m->sleepers == 0, 1)) {
+    htll_swap_uint32(&m->l.u, UNLOCKED);
+    if (__builtin_expect(m->sleepers == 0, 1))
+      return 0;
+    /* Somebody parked while we released. Outside of EBR the lock may be
+     * destroyed by now: wake any class, with only the address */
+    sys_futex(m, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
     return 0;
   }
-  asm volatile("mfence");
-  delay_ticks(HTLL_SPIN_TRIES_UNLOCK);
-  asm volatile("mfence");
-  if (m->l.b.locked == LOCKED) {
+#endif
+
+  /* Unlock. The lock may be destroyed as soon as it is released: keep it
+   * alive until we are done with it */
+  ebr_enter();
+  if (m->starving) {
+    /* Hand the lock over instead, barging threads cannot take it */
+    __atomic_fetch_or(&m->l.u, HTLL_GRANTED, __ATOMIC_SEQ_CST);
+    sys_futex(m, FUTEX_WAKE_BITSET_PRIVATE, 1, NULL, NULL,
+              HTLL_FUTEX_STARVING);
+    ebr_exit();
     return 0;
   }
-  asm volatile("mfence");
-  /* We need to wake someone up */
-  m->l.b.contended = UNCONTENDED;
-  m->cnt_wake++;
-  sys_futex(m, FUTEX_WAKE_PRIVATE, LOCKED, NULL, NULL, 0);
+#if NO_INDIRECTION
+  /* There were sleepers while we held it: wake one, from the state read
+   * before the release (EBR keeps it, not the lock) */
+  htll_state_t *s = m->state;
+  htll_swap_uint32(&m->l.u, UNLOCKED);
+  htll_mutex_wake(m, s);
+#else
+  htll_swap_uint32(&m->l.u, UNLOCKED);
+  /* Leave a spinner the chance to take the lock: the wake is then left to
+   * its own unlock */
+  htll_delay(htll_ticks.unlock_delay);
+  if (m->l.b.locked == UNLOCKED) {
+    htll_mutex_wake(m, &m->state);
+  }
+#endif
+  ebr_exit();
   return 0;
 }
 
 int htll_mutex_trylock(htll_mutex_t *m, htll_context_t *me) {
   unsigned c = htll_swap_uint8(&m->l.b.locked, 1);
-  if (!c)
+  if (!c) {
+    htll_acquired_fast(m, 0);
     return 0;
+  }
   return EBUSY;
 }
 
-void htll_application_init(void) {}
+void htll_application_init(void) {
+  htll_ticks.spin_lock = timebase_ns_to_ticks(HTLL_SPIN_LOCK_NS);
+  htll_ticks.spin_spinlock = timebase_ns_to_ticks(HTLL_SPIN_SPINLOCK_NS);
+  htll_ticks.unlock_delay = timebase_ns_to_ticks(HTLL_UNLOCK_DELAY_NS);
+  htll_ticks.spin_min = timebase_ns_to_ticks(HTLL_SPIN_MIN_NS);
+  htll_ticks.spin_max = timebase_ns_to_ticks(HTLL_SPIN_MAX_NS);
+  htll_ticks.park_cost = timebase_ns_to_ticks(HTLL_PARK_COST_NS);
+  htll_ticks.yield_max = timebase_ns_to_ticks(HTLL_YIELD_MAX_NS);
+  htll_ticks.wait_yield = timebase_ns_to_ticks(HTLL_WAIT_YIELD_NS);
+  htll_ticks.wait_spin = timebase_ns_to_ticks(HTLL_WAIT_SPIN_NS);
+  htll_ticks.starve = timebase_ns_to_ticks(HTLL_STARVE_NS);
+  htll_ticks.critical = timebase_ns_to_ticks(HTLL_CRITICAL_LATENCY_NS);
+  htll_state_load();
+}
 
-void htll_application_exit(void) {}
+void htll_application_exit(void) {
+#if HTLL_STATS
+  uint64_t n = htll_stats.expired;
+  if (n || htll_stats.acquired)
+    fprintf(stderr,
+            "htll: %" PRIu64 " reorder windows expired (%" PRIu64
+            " ended by the lock), overshoot avg %" PRIu64 " ns max %" PRIu64
+            " ns\n",
+            n, htll_stats.acquired,
+            n ? timebase_ticks_to_ns(htll_stats.overshoot / n) : 0,
+            timebase_ticks_to_ns(htll_stats.overshoot_max));
+#endif
+  htll_state_save();
+}
 
 void htll_thread_start(void) {
-  for (int i = 0; i < MAX_SEGMENT; i++) {
-    segment[i].wait_time = DEFAULT_REORDER;
-    segment[i].unit = DEFAULT_ADJUST_UNIT;
-  }
-  cur_segment_id = -1;
+  htll_thread_t *t = htll_self();
+  t->segment = NULL;
+  t->cur_segment = NULL;
+  t->cur_segment_id = -1;
+  t->stack_pos = -1;
 }
 
-void htll_thread_exit(void) {}
+void htll_thread_exit(void) {
+  htll_thread_t *t = htll_self();
+  for (int n = 0; t->segment && n < HTLL_SEGMENT_PAGES; n++) {
+    if (!t->segment[n])
+      continue;
+    for (int i = 0; i < HTLL_SEGMENT_PAGE; i++)
+      free(t->segment[n][i].hist);
+    free(t->segment[n]);
+  }
+  free(t->segment);
+  t->segment = NULL;
+}
 
 int upmutex_cond1_init(upmutex_cond1_t *c, const pthread_condattr_t *a) {
   (void)a;
@@ -193,9 +908,10 @@ int upmutex_cond1_broadcast(upmutex_cond1_t *c) {
   /* We are waking everyone up */
   __sync_fetch_and_add(&c->seq, 1);
 
-  /* Wake one thread, and requeue the rest on the mutex */
-  sys_futex(&c->seq, FUTEX_REQUEUE_PRIVATE, 1, (struct timespec *)INT_MAX, m,
-            0);
+  /* Wake them all. Requeueing them on the mutex would put them to sleep
+   * there without being counted in its sleepers, and unlock would not wake
+   * them */
+  sys_futex(&c->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 
   return 0;
 }
@@ -218,13 +934,7 @@ int upmutex_cond1_wait(upmutex_cond1_t *c, htll_mutex_t *m,
 
   sys_futex(&c->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
 
-  while (htll_swap_uint32(&m->l.b.locked, 257) & 1) {
-    sys_futex(m, FUTEX_WAIT_PRIVATE, 257,
-              (struct timespec[]){{0, segment[cur_segment_id].wait_time}}, NULL,
-              0);
-
-    segment[cur_segment_id].has_waiter = 1;
-  }
+  htll_mutex_relock(m);
 
   return 0;
 }
@@ -280,20 +990,298 @@ int htll_cond_timedwait(upmutex_cond1_t *c, htll_mutex_t *m, htll_context_t *me,
   }
 
 timeout:
-  while (htll_swap_uint32(&m->l.b.locked, 257) & 1) {
-    sys_futex(m, FUTEX_WAIT_PRIVATE, 257,
-              (struct timespec[]){{0, segment[cur_segment_id].wait_time}}, NULL,
-              0);
+  htll_mutex_relock(m);
+
+  return ret;
+}
+
+static inline int htll_deadline_valid(clockid_t clock,
+                                      const struct timespec *abstime) {
+  return (clock == CLOCK_MONOTONIC || clock == CLOCK_REALTIME) &&
+         abstime->tv_nsec >= 0 && abstime->tv_nsec < 1000000000;
+}
+
+/* Futex wait, bounded by an absolute deadline of the given clock if any. The
+ * kernel checks the deadline, so the wait never ends early and no time is read
+ * in user space */
+static int htll_futex_wait_until(volatile void *addr, unsigned val,
+                                 clockid_t clock,
+                                 const struct timespec *abstime) {
+  if (!abstime) {
+    sys_futex((void *)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+    return 0;
+  }
+  int op = FUTEX_WAIT_BITSET_PRIVATE;
+  if (clock == CLOCK_REALTIME)
+    op |= FUTEX_CLOCK_REALTIME;
+  if (sys_futex((void *)addr, op, val, (struct timespec *)abstime, NULL,
+                FUTEX_BITSET_MATCH_ANY) == -1 &&
+      errno == ETIMEDOUT)
+    return ETIMEDOUT;
+  return 0;
+}
+
+/* Same waiting policy as htll_mutex_lock, then park until the deadline */
+int htll_mutex_timedlock(htll_mutex_t *m, htll_context_t *me, clockid_t clock,
+                         const struct timespec *abstime) {
+  if (!htll_swap_uint8(&m->l.b.locked, LOCKED)) {
+    htll_acquired_fast(m, 0);
+    return 0;
+  }
+
+  if (!htll_deadline_valid(clock, abstime))
+    return EINVAL;
 
-    segment[cur_segment_id].has_waiter = 1;
+  htll_state_t *s = htll_state(m);
+  if (htll_mutex_wait_briefly(m, s, 0)) {
+    htll_handoff(m, s, 0);
+    return 0;
+  }
+
+  int op = FUTEX_WAIT_BITSET_PRIVATE;
+  if (clock == CLOCK_REALTIME)
+    op |= FUTEX_CLOCK_REALTIME;
+#if HTLL_EDF
+  uint64_t deadline =
+      htll_edf_deadline(cur_segment(htll_self()), htll_getticks());
+  if (htll_edf_wait(m, deadline, op, abstime) == ETIMEDOUT)
+    return ETIMEDOUT;
+  htll_handoff(m, s, 0);
+  return 0;
+#endif
+  while (1) {
+    int ret = htll_mutex_park(m, op, (struct timespec *)abstime);
+    if (ret == 1)
+      break;
+    if (ret == ETIMEDOUT) {
+      /* Still take the lock if it was released in the meantime */
+      if (htll_swap_uint8(&m->l.b.locked, LOCKED))
+        return ETIMEDOUT;
+      break;
+    }
+  }
+  htll_handoff(m, s, 0);
+  return 0;
+}
+
+#if SUPPORT_RWLOCK
+static slab_t htll_rwlock_slab =
+    SLAB_INITIALIZER(sizeof(htll_rwlock_t), L_CACHE_LINE_SIZE);
+
+htll_rwlock_t *htll_rwlock_create(const pthread_rwlockattr_t *attr) {
+  htll_rwlock_t *rw = (htll_rwlock_t *)slab_alloc(&htll_rwlock_slab);
+  memset(rw, 0, sizeof(*rw));
+  htll_state_init(&rw->wlock.state);
+  return rw;
+}
+
+int htll_rwlock_destroy(htll_rwlock_t *rw) {
+  /* Slab memory stays mapped: a late reader touching the counters or waking
+   * the writer after the destruction is harmless */
+  slab_free(&htll_rwlock_slab, rw);
+  return 0;
+}
+
+/* Threads running on the same CPU share a slot without contending on it. The
+ * slot is remembered for the unlock, which saves a second sched_getcpu() */
+static inline volatile int *htll_rw_slot(htll_rwlock_t *rw, lp_thread_t *t) {
+  t->lock.rw_slot = (unsigned)sched_getcpu() & (HTLL_RW_SLOTS - 1);
+  return &rw->readers[t->lock.rw_slot].count;
+}
+
+/* A reader leaves from the slot of its thread's last read lock, which is not
+ * the one it entered through when read locks nest: the counters are only
+ * meaningful summed */
+static inline int htll_rw_readers(htll_rwlock_t *rw) {
+  int sum = 0;
+  for (int i = 0; i < HTLL_RW_SLOTS; i++)
+    sum += rw->readers[i].count;
+  return sum;
+}
+
+static inline void htll_rw_read_leave(htll_rwlock_t *rw, volatile int *slot) {
+  __atomic_sub_fetch(slot, 1, __ATOMIC_SEQ_CST);
+  if (__htll_unlikely(rw->wsleep)) {
+    __atomic_add_fetch(&rw->rseq, 1, __ATOMIC_SEQ_CST);
+    sys_futex((void *)&rw->rseq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+int htll_rwlock_timedrdlock(htll_rwlock_t *rw, htll_context_t *me,
+                            clockid_t clock, const struct timespec *abstime) {
+  volatile int *slot = htll_rw_slot(rw, lp_thread());
+
+  if (abstime && !htll_deadline_valid(clock, abstime))
+    return EINVAL;
+
+  while (1) {
+    __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+    if (__builtin_expect(rw->writer == 0, 1))
+      return 0;
+
+    /* A writer is in or waiting for the readers to drain: back off */
+    htll_rw_read_leave(rw, slot);
+    HTLL_FOR_N_CYCLES(
+        htll_ticks.spin_lock, if (rw->writer == 0) { break; });
+    uint32_t w;
+    while ((w = rw->writer) != 0) {
+      if (w == 1 && !__sync_bool_compare_and_swap(&rw->writer, 1, 2))
+        continue;
+      if (htll_futex_wait_until(&rw->writer, 2, clock, abstime) == ETIMEDOUT)
+        return ETIMEDOUT;
+    }
   }
+}
+
+int htll_rwlock_rdlock(htll_rwlock_t *rw, htll_context_t *me) {
+  return htll_rwlock_timedrdlock(rw, me, CLOCK_REALTIME, NULL);
+}
+
+int htll_rwlock_tryrdlock(htll_rwlock_t *rw, htll_context_t *me) {
+  volatile int *slot = htll_rw_slot(rw, lp_thread());
+
+  __atomic_add_fetch(slot, 1, __ATOMIC_SEQ_CST);
+  if (rw->writer == 0)
+    return 0;
+  htll_rw_read_leave(rw, slot);
+  return EBUSY;
+}
+
+static void htll_rw_write_leave(htll_rwlock_t *rw, htll_context_t *me) {
+  rw->owner = NULL;
+  if (htll_swap_uint32(&rw->writer, 0) == 2)
+    sys_futex((void *)&rw->writer, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  htll_mutex_unlock(&rw->wlock, me);
+}
+
+/* Called with the writer flag up */
+static int htll_rw_wait_readers(htll_rwlock_t *rw, clockid_t clock,
+                                const struct timespec *abstime) {
+  if (htll_rw_readers(rw) == 0)
+    return 0;
+  HTLL_FOR_N_CYCLES(
+      htll_ticks.spin_lock, if (htll_rw_readers(rw) == 0) { return 0; });
 
+  int ret = 0;
+  __atomic_store_n(&rw->wsleep, 1, __ATOMIC_SEQ_CST);
+  while (1) {
+    uint32_t seq = rw->rseq;
+    if (htll_rw_readers(rw) == 0)
+      break;
+    if (htll_futex_wait_until(&rw->rseq, seq, clock, abstime) == ETIMEDOUT) {
+      ret = ETIMEDOUT;
+      break;
+    }
+  }
+  rw->wsleep = 0;
   return ret;
 }
 
-static inline int htll_mutex_timedlock(htll_mutex_t *l,
-                                       const struct timespec *ts) {
-  fprintf(stderr, "** warning -- pthread_mutex_timedlock not implemented\n");
+int htll_rwlock_timedwrlock(htll_rwlock_t *rw, htll_context_t *me,
+                            clockid_t clock, const struct timespec *abstime) {
+  int ret = abstime ? htll_mutex_timedlock(&rw->wlock, me, clock, abstime)
+                    : htll_mutex_lock(&rw->wlock, me);
+  if (ret)
+    return ret;
+
+  /* Only the holder of wlock raises the flag */
+  __atomic_store_n(&rw->writer, 1, __ATOMIC_SEQ_CST);
+  ret = htll_rw_wait_readers(rw, clock, abstime);
+  if (ret) {
+    htll_rw_write_leave(rw, me);
+    return ret;
+  }
+  rw->owner = lp_thread();
+  return 0;
+}
+
+int htll_rwlock_wrlock(htll_rwlock_t *rw, htll_context_t *me) {
+  return htll_rwlock_timedwrlock(rw, me, CLOCK_REALTIME, NULL);
+}
+
+int htll_rwlock_trywrlock(htll_rwlock_t *rw, htll_context_t *me) {
+  if (htll_mutex_trylock(&rw->wlock, me))
+    return EBUSY;
+  __atomic_store_n(&rw->writer, 1, __ATOMIC_SEQ_CST);
+  if (htll_rw_readers(rw) != 0) {
+    htll_rw_write_leave(rw, me);
+    return EBUSY;
+  }
+  rw->owner = lp_thread();
+  return 0;
+}
+
+int htll_rwlock_unlock(htll_rwlock_t *rw, htll_context_t *me) {
+  lp_thread_t *t = lp_thread();
+
+  if (rw->owner == t)
+    htll_rw_write_leave(rw, me);
+  else
+    htll_rw_read_leave(rw, &rw->readers[t->lock.rw_slot].count);
+  return 0;
+}
+#endif
+
+/* pthread_spinlock_t may be process-shared and has no room to record it, so
+ * spinlocks park on shared futexes. Parking is the slow path anyway */
+int htll_spin_init(htll_spinlock_t *l, int pshared) {
+  l->u = UNLOCKED;
+  return 0;
+}
+
+int htll_spin_destroy(htll_spinlock_t *l) { return 0; }
+
+int htll_spin_lock(htll_spinlock_t *l) {
+  if (!htll_swap_uint8(&l->b.locked, LOCKED)) {
+    return 0;
+  }
+
+  uint64_t spin_ticks = htll_ticks.spin_spinlock;
+  segment_t *seg = cur_segment(htll_self());
+  int parked = 0;
+  while (1) {
+    if (parked) {
+      /* Other sleepers may be parked behind us: only watch the byte, the
+       * swap below takes the lock with the contended bit kept set */
+      uint64_t start = htll_getticks();
+      while (l->b.locked && htll_getticks() - start <= spin_ticks)
+        htll_pause();
+    } else if (htll_spin(&l->b.locked, spin_ticks, 0)) {
+      /* No room for a spinner count: minimal backoff cap */
+      return 0;
+    }
+
+    /* The holder is probably preempted: stop burning the core */
+    if ((htll_swap_uint32(&l->u, LOCKED_AND_CONTENDED) & LOCKED) == UNLOCKED)
+      return 0;
+
+    if (seg) {
+      sys_futex(l, FUTEX_WAIT, LOCKED_AND_CONTENDED,
+                (struct timespec[]){htll_reltime(segment_window(seg))}, NULL, 0);
+      seg->has_waiter = 1;
+      parked = 1;
+      spin_ticks = spin_ticks * 2;
+      if (spin_ticks > htll_ticks.yield_max)
+        spin_ticks = htll_ticks.yield_max;
+    } else {
+      while (htll_swap_uint32(&l->u, LOCKED_AND_CONTENDED) & LOCKED)
+        sys_futex(l, FUTEX_WAIT, LOCKED_AND_CONTENDED, NULL, NULL, 0);
+      return 0;
+    }
+  }
+}
+
+int htll_spin_trylock(htll_spinlock_t *l) {
+  if (!htll_swap_uint8(&l->b.locked, LOCKED))
+    return 0;
+  return EBUSY;
+}
+
+int htll_spin_unlock(htll_spinlock_t *l) {
+  /* Release with one swap: the lock may be freed as soon as it is seen
+   * unlocked, so only its address is used afterwards */
+  if (htll_swap_uint32(&l->u, UNLOCKED) == LOCKED_AND_CONTENDED)
+    sys_futex(l, FUTEX_WAKE, 1, NULL, NULL, 0);
   return 0;
 }
 
@@ -301,57 +1289,353 @@ static inline int htll_mutex_timedlock(htll_mutex_t *l,
 /* Per-thread private stack */
 
 /* A stack to implement nested segment */
-#define MAX_DEPTH 30
-__thread int segment_stack[MAX_DEPTH];
-__thread int stack_pos = -1;
-
-int push_segment(int segment_id) {
-  stack_pos++;
-  if (stack_pos == MAX_SEGMENT)
+int push_segment(htll_thread_t *t, int segment_id) {
+  if (t->stack_pos + 1 >= MAX_DEPTH)
     return -ENOSPC;
-  segment_stack[stack_pos] = segment_id;
+  t->segment_stack[++t->stack_pos] = segment_id;
   return 0;
 }
 
 /* Per-thread private stack */
-int pop_segment(void) {
-  if (stack_pos < 0)
+int pop_segment(htll_thread_t *t) {
+  if (t->stack_pos < 0)
     return -EINVAL;
-  return segment_stack[stack_pos--];
+  return t->segment_stack[t->stack_pos--];
+}
+
+int is_stack_empty(htll_thread_t *t) { return t->stack_pos < 0; }
+
+/* Process-wide part of a segment, its page allocated on first use */
+static segment_info_t *segment_info(int segment_id) {
+  segment_info_t **page = &htll_segment_info[segment_id / HTLL_SEGMENT_PAGE];
+  segment_info_t *p = __atomic_load_n(page, __ATOMIC_ACQUIRE);
+  if (__htll_unlikely(!p)) {
+    segment_info_t *n =
+        aligned_alloc(CACHE_LINE_SIZE, HTLL_SEGMENT_PAGE * sizeof(*n));
+    if (!n)
+      return NULL;
+    memset(n, 0, HTLL_SEGMENT_PAGE * sizeof(*n));
+    if (__atomic_compare_exchange_n(page, &p, n, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      p = n;
+    else
+      free(n);
+  }
+  return &p[segment_id % HTLL_SEGMENT_PAGE];
+}
+
+static segment_t *segment_page_alloc(htll_thread_t *t, int n) {
+  segment_t *page = calloc(HTLL_SEGMENT_PAGE, sizeof(segment_t));
+  if (!page)
+    return NULL;
+  for (int i = 0; i < HTLL_SEGMENT_PAGE; i++) {
+    segment_info_t *info = segment_info(n * HTLL_SEGMENT_PAGE + i);
+    if (!info) {
+      free(page);
+      return NULL;
+    }
+    /* wait_time stays 0 until the thread first starts the segment */
+    page[i].info = info;
+  }
+  t->segment[n] = page;
+  return page;
+}
+
+/* Warm start from what the other threads learned so far */
+static void segment_warm(segment_t *seg) {
+  segment_info_t *info = seg->info;
+  uint64_t wait_time =
+      __atomic_load_n(&info->model.wait_time, __ATOMIC_RELAXED);
+  uint64_t unit = __atomic_load_n(&info->model.unit, __ATOMIC_RELAXED);
+  seg->wait_time = wait_time ? wait_time : DEFAULT_REORDER;
+  seg->unit = unit ? unit : DEFAULT_ADJUST_UNIT;
+}
+
+/* The calling thread's part of a segment */
+static inline segment_t *segment_get(htll_thread_t *t, int segment_id) {
+  segment_t *page = t->segment[segment_id / HTLL_SEGMENT_PAGE];
+  if (__htll_unlikely(!page)) {
+    page = segment_page_alloc(t, segment_id / HTLL_SEGMENT_PAGE);
+    if (!page)
+      return NULL;
+  }
+  return &page[segment_id % HTLL_SEGMENT_PAGE];
+}
+
+static int segment_table_alloc(htll_thread_t *t) {
+  t->segment = calloc(HTLL_SEGMENT_PAGES, sizeof(segment_t *));
+  if (!t->segment)
+    return -ENOMEM;
+  /* The default slack alone would exceed the shortest reorder windows */
+  prctl(PR_SET_TIMERSLACK, HTLL_TIMER_SLACK_NS, 0, 0, 0);
+  return 0;
+}
+
+/* Fold the window of the thread into the process-wide one, from time to
+ * time. Racing folds may lose one another, which only slows convergence */
+static inline void segment_fold(segment_t *seg) {
+  if (++seg->ends % HTLL_SEGMENT_FOLD)
+    return;
+  uint64_t *wait_time = &seg->info->model.wait_time;
+  uint64_t *unit = &seg->info->model.unit;
+  uint64_t w = __atomic_load_n(wait_time, __ATOMIC_RELAXED);
+  uint64_t u = __atomic_load_n(unit, __ATOMIC_RELAXED);
+  if (!w) {
+    w = seg->wait_time;
+    u = seg->unit;
+  } else {
+    w = w - (w >> HTLL_SEGMENT_FOLD_SHIFT) +
+        (seg->wait_time >> HTLL_SEGMENT_FOLD_SHIFT);
+    u = u - (u >> HTLL_SEGMENT_FOLD_SHIFT) +
+        (seg->unit >> HTLL_SEGMENT_FOLD_SHIFT);
+  }
+  __atomic_store_n(wait_time, w, __ATOMIC_RELAXED);
+  __atomic_store_n(unit, u, __ATOMIC_RELAXED);
+}
+
+/* Back to the enclosing segment, if any */
+static inline void segment_leave(htll_thread_t *t) {
+  int segment_id = is_stack_empty(t) ? -1 : pop_segment(t);
+  t->cur_segment_id = segment_id;
+  /* Its page is there already */
+  t->cur_segment = segment_id < 0 ? NULL : segment_get(t, segment_id);
+}
+
+static uint32_t htll_hash(const char *name) {
+  uint32_t h = 2166136261U;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 16777619U;
+  return h;
+}
+
+static int segment_new(const char *name) {
+  int segment_id = __atomic_fetch_add(&htll_segment_next, 1, __ATOMIC_RELAXED);
+  if (segment_id >= HTLL_SEGMENT_MAX) {
+    __atomic_store_n(&htll_segment_next, HTLL_SEGMENT_MAX, __ATOMIC_RELAXED);
+    return -ENOSPC;
+  }
+  segment_info_t *info = segment_info(segment_id);
+  if (!info || !(info->name = strdup(name)))
+    return -ENOMEM;
+  return segment_id;
+}
+
+/* Ids of the application, or handed out by segment_register */
+static inline int segment_id_valid(int segment_id) {
+  return segment_id >= 0 &&
+         (segment_id < MAX_SEGMENT ||
+          (segment_id < HTLL_SEGMENT_MAX &&
+           segment_id < __atomic_load_n(&htll_segment_next, __ATOMIC_RELAXED)));
 }
 
-int is_stack_empty(void) { return stack_pos < 0; }
+int segment_register(const char *name) {
+  if (!name)
+    return -EINVAL;
+  const uint32_t mask = 2 * HTLL_SEGMENT_MAX - 1;
+  int mine = -1;
+  /* Never full: there are twice as many slots as ids */
+  for (uint32_t i = htll_hash(name) & mask;; i = (i + 1) & mask) {
+    int slot = __atomic_load_n(&htll_segment_names[i], __ATOMIC_ACQUIRE);
+    while (!slot) {
+      if (mine < 0 && (mine = segment_new(name)) < 0)
+        return mine;
+      if (__atomic_compare_exchange_n(&htll_segment_names[i], &slot, mine + 1,
+                                      0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return mine;
+    }
+    /* If another thread registered the same name first, mine stays unused */
+    if (!strcmp(segment_info(slot - 1)->name, name))
+      return slot - 1;
+  }
+}
 
 int segment_start(int segment_id) {
-  if (segment_id < 0 || segment_id > MAX_SEGMENT || cur_segment_id < -1)
+  htll_thread_t *t = htll_self();
+  if (!segment_id_valid(segment_id) || t->cur_segment_id < -1)
     return -EINVAL;
-  if (push_segment(cur_segment_id) < 0)
+  if (__builtin_expect(t->segment == NULL, 0) && segment_table_alloc(t) < 0)
+    return -ENOMEM;
+  segment_t *seg = segment_get(t, segment_id);
+  if (!seg)
+    return -ENOMEM;
+  if (__htll_unlikely(!seg->wait_time))
+    segment_warm(seg);
+  if (push_segment(t, t->cur_segment_id) < 0)
     return -ENOSPC;
   /* Set cur_segment_id */
-  cur_segment_id = segment_id;
+  t->cur_segment_id = segment_id;
+  t->cur_segment = seg;
   /* Get the segment start time */
-  segment[cur_segment_id].start_ts = htll_getticks();
+  seg->start_ts = htll_getticks();
+  seg->deadline = 0;
+  return 0;
+}
+
+/* CLOCK_MONOTONIC ns to ticks and back, around the current time. A time
+ * already past maps to 0 */
+static uint64_t htll_ns_to_ts(uint64_t ns) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t ts = htll_getticks();
+  uint64_t now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  return ns > now_ns ? ts + timebase_ns_to_ticks(ns - now_ns) : 0;
+}
+
+static uint64_t htll_ts_to_ns(uint64_t ts) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t cur = htll_getticks();
+  uint64_t now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  return ts > cur ? now_ns + timebase_ticks_to_ns(ts - cur)
+                  : now_ns - timebase_ticks_to_ns(cur - ts);
+}
+
+int segment_start_deadline(int segment_id, uint64_t deadline) {
+  int ret = segment_start(segment_id);
+  if (ret < 0)
+    return ret;
+  segment_t *seg = htll_self()->cur_segment;
+  uint64_t ts = htll_ns_to_ts(deadline);
+  if (ts) {
+    seg->deadline = ts;
+    seg->latency = timebase_ticks_to_ns(ts - seg->start_ts);
+  } else {
+    /* Late from the start: no window to learn from */
+    seg->deadline = seg->start_ts;
+    seg->latency = 0;
+  }
+  return 0;
+}
+
+uint64_t segment_deadline(void) {
+  segment_t *seg = cur_segment(htll_self());
+  if (!seg)
+    return 0;
+  if (seg->deadline)
+    return htll_ts_to_ns(seg->deadline);
+  if (!seg->latency)
+    return 0;
+  return htll_ts_to_ns(seg->start_ts + timebase_ns_to_ticks(seg->latency));
+}
+
+int segment_set_slo(int segment_id, uint64_t latency, double percentile) {
+  if (!segment_id_valid(segment_id) || !(percentile >= 0 && percentile < 100))
+    return -EINVAL;
+  /* In hundredths, at most 99.99: the tail must keep samples */
+  unsigned int hundredths = (unsigned int)(percentile * 100 + 0.5);
+  if (hundredths >= 10000)
+    return -EINVAL;
+  segment_info_t *info = segment_info(segment_id);
+  if (!info)
+    return -ENOMEM;
+  __atomic_store_n(&info->slo_percentile, hundredths, __ATOMIC_RELAXED);
+  __atomic_store_n(&info->slo_latency, latency, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static inline unsigned int htll_slo_bucket(uint64_t ns) {
+  if (ns < 4)
+    return ns;
+  int msb = 63 - __builtin_clzll(ns);
+  return (msb << 2) | ((ns >> (msb - 2)) & 3);
+}
+
+/* Upper bound of a bucket, in ns */
+static inline uint64_t htll_slo_bucket_max(unsigned int b) {
+  if (b < 8)
+    return b < 4 ? b + 1 : 4;
+  return (uint64_t)(5 + (b & 3)) << ((b >> 2) - 2);
+}
+
+/* Steer the reorder window of seg so that the given percentile of its
+ * durations stays under latency. The durations are collected over periods
+ * long enough to see HTLL_SLO_TAIL of them above the percentile; at the end
+ * of each, the window shrinks in proportion to the excess, or grows by an
+ * eighth when the percentile is clearly under the target */
+static int segment_slo_update(segment_t *seg, uint64_t duration,
+                              uint64_t latency, unsigned int percentile) {
+  if (__htll_unlikely(!seg->hist)) {
+    seg->hist = calloc(HTLL_SLO_BUCKETS, sizeof(uint32_t));
+    if (!seg->hist)
+      return -ENOMEM;
+  }
+  seg->hist[htll_slo_bucket(duration)]++;
+  uint32_t tail = 10000 - percentile;
+  if (++seg->samples < HTLL_SLO_TAIL * 10000 / tail)
+    return 0;
+
+  /* The duration under which percentile of the samples are */
+  uint64_t above = (uint64_t)seg->samples * tail / 10000, seen = 0;
+  int b = HTLL_SLO_BUCKETS - 1;
+  for (; b > 0; b--) {
+    seen += seg->hist[b];
+    if (seen > above)
+      break;
+  }
+  uint64_t observed = htll_slo_bucket_max(b);
+  uint64_t wait_time = seg->wait_time;
+  if (observed > latency) {
+    if (observed > 2 * latency)
+      wait_time >>= 1;
+    else
+      wait_time = wait_time * latency / observed;
+  } else if (observed < latency - (latency >> HTLL_SLO_BAND_SHIFT)) {
+    wait_time += wait_time >> 3;
+  }
+  if (wait_time < MIN_REORDER)
+    wait_time = MIN_REORDER;
+  seg->wait_time = wait_time;
+  memset(seg->hist, 0, HTLL_SLO_BUCKETS * sizeof(uint32_t));
+  seg->samples = 0;
   return 0;
 }
 
 int segment_end(int segment_id, uint64_t required_latency) {
+  htll_thread_t *t = htll_self();
+  segment_t *seg = cur_segment(t);
+  /* Before any work: a mismatch leaves the nesting stack untouched */
+  if (!seg || segment_id != t->cur_segment_id)
+    return -EINVAL;
+  /* Late from the start, whatever the window: nothing to learn */
+  if (seg->deadline && !seg->latency) {
+    seg->has_waiter = 0;
+    segment_leave(t);
+    return 0;
+  }
+  uint64_t slo = __atomic_load_n(&seg->info->slo_latency, __ATOMIC_RELAXED);
+  if (slo) {
+    unsigned int percentile =
+        __atomic_load_n(&seg->info->slo_percentile, __ATOMIC_RELAXED);
+    uint64_t duration = timebase_ticks_to_ns(htll_getticks() - seg->start_ts);
+    /* Against a deadline, what counts is the share of the budget used */
+    if (seg->deadline)
+      duration = duration * slo / seg->latency;
+    else
+      seg->latency = slo;
+    seg->has_waiter = 0;
+    int ret = segment_slo_update(seg, duration, slo, percentile);
+    segment_fold(seg);
+    segment_leave(t);
+    return ret;
+  }
+  /* A segment with a deadline must end within the budget it started with */
+  if (seg->deadline)
+    required_latency = seg->latency;
+  else
+    seg->latency = required_latency;
   uint64_t duration = 0;
   uint64_t segment_end_ts;
-  uint64_t has_waiter = segment[cur_segment_id].has_waiter;
-  uint64_t wait_time = segment[cur_segment_id].wait_time;
-  uint64_t unit = segment[cur_segment_id].unit;
+  uint64_t has_waiter = seg->has_waiter;
+  uint64_t wait_time = seg->wait_time;
+  uint64_t unit = seg->unit;
   segment_end_ts = htll_getticks();
-  duration = segment_end_ts - segment[cur_segment_id].start_ts;
+  duration = timebase_ticks_to_ns(segment_end_ts - seg->start_ts);
   if (has_waiter) {
     /* Fast out */
     if (required_latency < SEGMENT_REQ_THRESHOLD) {
-      segment[cur_segment_id].wait_time = MIN_REORDER;
+      seg->wait_time = MIN_REORDER;
       goto out;
     }
-    if (segment_id < 0 || segment_id > MAX_SEGMENT)
-      return -EINVAL;
-    if (segment_id != cur_segment_id)
-      return -EINVAL;
     /* Adjust the reorder window */
     if (duration > required_latency) {
       wait_time = wait_time >> 1;
@@ -363,15 +1647,362 @@ int segment_end(int segment_id, uint64_t required_latency) {
     }
     if (wait_time < MIN_REORDER)
       wait_time = MIN_REORDER;
-    segment[cur_segment_id].wait_time = wait_time;
+    seg->wait_time = wait_time;
   }
-  segment[cur_segment_id].has_waiter = 0;
-  segment[cur_segment_id].unit = unit;
+  seg->has_waiter = 0;
+  seg->unit = unit;
 out:
+  segment_fold(seg);
   /* Support nested segmentes */
-  if (is_stack_empty())
-    cur_segment_id = -1;
-  else
-    cur_segment_id = pop_segment();
+  segment_leave(t);
+  return 0;
+}
+
+/*
+ * State file, named by HTLL_STATE_FILE: the reorder windows learned for the
+ * segments and the hold time averages of the locks, loaded at startup, saved
+ * at exit and every HTLL_STATE_PERIOD seconds if set. Locks are known across
+ * runs by their offset in the module whose data holds them, and locks
+ * allocated at run time by the offset of the code that called
+ * pthread_mutex_init: all the locks of such a site share their entry, the
+ * last one bound is saved. The file is used in place (mmap): a header, the
+ * segments, then the locks sorted by site.
+ */
+#define HTLL_STATE_MAGIC "HTLLSTAT"
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nsegments;
+  uint32_t nlocks;
+  uint32_t reserved;
+} htll_state_header_t;
+
+typedef struct {
+  /* Registered name, empty for the ids picked by the application */
+  char name[HTLL_STATE_NAME];
+  int32_t id;
+  uint32_t reserved;
+  uint64_t wait_time;
+  uint64_t unit;
+} htll_state_segment_t;
+
+typedef struct {
+  uint64_t module;
+  uint64_t offset;
+  /* In ns */
+  uint64_t hold;
+  uint64_t gap;
+} htll_state_lock_t;
+
+static volatile int htll_state_busy;
+
+/* Data and code segments of the modules loaded at startup */
+static struct {
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t base;
+  uint64_t module;
+} htll_modules[HTLL_STATE_MODULES];
+static int htll_nmodules;
+
+/* Locks of the loaded file */
+static const htll_state_lock_t *htll_saved_locks;
+static uint32_t htll_nsaved_locks;
+
+/* Sites of this run, hashed by site: an entry is claimed once for good and
+ * then points to the state of the last lock bound to it, NULL once that
+ * lock is destroyed. A destroyed lock leaves its averages (in ticks) to the
+ * next lock of the site. The states are retired through EBR, so the save
+ * reads them inside a section */
+static struct {
+  uint64_t module;
+  uint64_t offset;
+  /* 1 while the site is written, 2 once it can be compared */
+  volatile int claimed;
+  htll_state_t *s;
+  uint64_t hold;
+  uint64_t gap;
+} htll_sites[HTLL_STATE_LOCKS];
+
+static int htll_module_add(struct dl_phdr_info *info, size_t size,
+                           void *data) {
+  (void)size;
+  (void)data;
+  /* The executable comes unnamed */
+  const char *name = info->dlpi_name;
+  char exe[PATH_MAX];
+  if (!name[0]) {
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    exe[len > 0 ? len : 0] = '\0';
+    name = exe;
+  }
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type != PT_LOAD || !(ph->p_flags & (PF_W | PF_X)) ||
+        htll_nmodules == HTLL_STATE_MODULES)
+      continue;
+    htll_modules[htll_nmodules].start = info->dlpi_addr + ph->p_vaddr;
+    htll_modules[htll_nmodules].end =
+        info->dlpi_addr + ph->p_vaddr + ph->p_memsz;
+    htll_modules[htll_nmodules].base = info->dlpi_addr;
+    htll_modules[htll_nmodules].module = htll_hash(name);
+    htll_nmodules++;
+  }
   return 0;
 }
+
+static int htll_site_cmp(const void *a, const void *b) {
+  const htll_state_lock_t *x = a, *y = b;
+  if (x->module != y->module)
+    return x->module < y->module ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Module segment holding addr, -1 if none */
+static int htll_module_find(const void *addr) {
+  for (int i = 0; i < htll_nmodules; i++)
+    if ((uintptr_t)addr >= htll_modules[i].start &&
+        (uintptr_t)addr < htll_modules[i].end)
+      return i;
+  return -1;
+}
+
+/* Entry of the site, claimed if new; -1 once the table is full */
+static int htll_site_slot(const htll_state_lock_t *key) {
+  uint64_t h = key->module ^ (key->offset * 0x9e3779b97f4a7c15ULL);
+  for (unsigned int n = 0; n < HTLL_STATE_LOCKS; n++) {
+    unsigned int i = (h + n) & (HTLL_STATE_LOCKS - 1);
+    int idle = 0;
+    if (__atomic_compare_exchange_n(&htll_sites[i].claimed, &idle, 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      htll_sites[i].module = key->module;
+      htll_sites[i].offset = key->offset;
+      __atomic_store_n(&htll_sites[i].claimed, 2, __ATOMIC_RELEASE);
+      return i;
+    }
+    while (__atomic_load_n(&htll_sites[i].claimed, __ATOMIC_ACQUIRE) != 2)
+      htll_pause();
+    if (htll_sites[i].module == key->module &&
+        htll_sites[i].offset == key->offset)
+      return i;
+  }
+  return -1;
+}
+
+/* Known by its address if static, otherwise by the code that initialized
+ * it, if given */
+static void htll_state_bind(htll_state_t *s, void *addr, const void *site) {
+  if (!htll_state_path)
+    return;
+  int i = htll_module_find(addr);
+  const void *at = addr;
+  if (i < 0 && site) {
+    i = htll_module_find(site);
+    at = site;
+  }
+  if (i < 0)
+    return;
+
+  htll_state_lock_t key = {htll_modules[i].module,
+                           (uintptr_t)at - htll_modules[i].base, 0, 0};
+  const htll_state_lock_t *saved =
+      htll_nsaved_locks ? bsearch(&key, htll_saved_locks, htll_nsaved_locks,
+                                  sizeof(key), htll_site_cmp)
+                        : NULL;
+  if (saved) {
+    s->hold = timebase_ns_to_ticks(saved->hold);
+    s->gap = timebase_ns_to_ticks(saved->gap);
+  }
+
+  int n = htll_site_slot(&key);
+  if (n < 0) {
+    static int warned;
+    if (!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+      fprintf(stderr, "htll: more than %d lock sites, the others are not saved\n",
+              HTLL_STATE_LOCKS);
+    return;
+  }
+  /* What this run learned beats the file */
+  if (htll_sites[n].hold || htll_sites[n].gap) {
+    s->hold = htll_sites[n].hold;
+    s->gap = htll_sites[n].gap;
+  }
+  __atomic_store_n(&htll_sites[n].s, s, __ATOMIC_RELEASE);
+  s->site = n + 1;
+}
+
+static void htll_state_unbind(htll_state_t *s) {
+  /* Unless a later lock of the same site took the entry over */
+  htll_state_t *self = s;
+  if (s->site) {
+    if (s->hold || s->gap) {
+      htll_sites[s->site - 1].hold = s->hold;
+      htll_sites[s->site - 1].gap = s->gap;
+    }
+    __atomic_compare_exchange_n(&htll_sites[s->site - 1].s, &self, NULL, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+  s->site = 0;
+}
+
+static void htll_state_load_file(void) {
+  int fd = open(htll_state_path, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (!fstat(fd, &st) && (size_t)st.st_size >= sizeof(htll_state_header_t))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+
+  const htll_state_header_t *h = map;
+  const htll_state_segment_t *segs = (const void *)(h + 1);
+  if (memcmp(h->magic, HTLL_STATE_MAGIC, sizeof(h->magic)) ||
+      h->version != HTLL_STATE_VERSION ||
+      (size_t)st.st_size != sizeof(*h) + h->nsegments * sizeof(*segs) +
+                                h->nlocks * sizeof(htll_state_lock_t)) {
+    fprintf(stderr, "htll: ignoring %s (not a version %d state file)\n",
+            htll_state_path, HTLL_STATE_VERSION);
+    munmap(map, st.st_size);
+    return;
+  }
+
+  for (uint32_t i = 0; i < h->nsegments; i++) {
+    int id = segs[i].id;
+    if (segs[i].name[0]) {
+      if (segs[i].name[HTLL_STATE_NAME - 1])
+        continue;
+      id = segment_register(segs[i].name);
+    } else if (id >= MAX_SEGMENT) {
+      continue;
+    }
+    segment_info_t *info = id >= 0 ? segment_info(id) : NULL;
+    if (!info)
+      continue;
+    info->model.wait_time = segs[i].wait_time;
+    info->model.unit = segs[i].unit;
+  }
+  /* The locks are looked up in place, the mapping is kept */
+  htll_saved_locks = (const void *)(segs + h->nsegments);
+  htll_nsaved_locks = h->nlocks;
+}
+
+static void htll_state_tick(union sigval v) {
+  (void)v;
+  htll_state_save();
+}
+
+static void htll_state_load(void) {
+  htll_state_path = getenv("HTLL_STATE_FILE");
+  if (!htll_state_path)
+    return;
+  dl_iterate_phdr(htll_module_add, NULL);
+  htll_state_load_file();
+
+  const char *period = getenv("HTLL_STATE_PERIOD");
+  int seconds = period ? atoi(period) : 0;
+  if (seconds > 0) {
+    /* The notifications run on threads of the libc, unknown to us */
+    struct sigevent sev = {.sigev_notify = SIGEV_THREAD,
+                           .sigev_notify_function = htll_state_tick};
+    struct itimerspec its = {{seconds, 0}, {seconds, 0}};
+    timer_t timer;
+    if (!timer_create(CLOCK_MONOTONIC, &sev, &timer))
+      timer_settime(timer, 0, &its, NULL);
+  }
+}
+
+static int htll_state_write(int fd, const void *buf, size_t len) {
+  for (const char *p = buf; len;) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void htll_state_save(void) {
+  if (!htll_state_path || __sync_lock_test_and_set(&htll_state_busy, 1))
+    return;
+
+  int next = __atomic_load_n(&htll_segment_next, __ATOMIC_RELAXED);
+  htll_state_segment_t *segs = calloc(next, sizeof(*segs));
+  htll_state_lock_t *locks =
+      calloc(HTLL_STATE_LOCKS + htll_nsaved_locks + 1, sizeof(*locks));
+  uint32_t nsegs = 0, nlocks = 0;
+  if (!segs || !locks)
+    goto out;
+
+  for (int id = 0; id < next; id++) {
+    segment_info_t *page = __atomic_load_n(
+        &htll_segment_info[id / HTLL_SEGMENT_PAGE], __ATOMIC_ACQUIRE);
+    if (!page)
+      continue;
+    segment_info_t *info = &page[id % HTLL_SEGMENT_PAGE];
+    uint64_t wait_time =
+        __atomic_load_n(&info->model.wait_time, __ATOMIC_RELAXED);
+    if (!wait_time ||
+        (info->name && strlen(info->name) >= HTLL_STATE_NAME))
+      continue;
+    if (info->name)
+      strcpy(segs[nsegs].name, info->name);
+    segs[nsegs].id = id;
+    segs[nsegs].wait_time = wait_time;
+    segs[nsegs].unit = __atomic_load_n(&info->model.unit, __ATOMIC_RELAXED);
+    nsegs++;
+  }
+
+  ebr_enter();
+  for (unsigned int i = 0; i < HTLL_STATE_LOCKS; i++) {
+    htll_state_t *s = __atomic_load_n(&htll_sites[i].s, __ATOMIC_ACQUIRE);
+    uint64_t hold = s ? s->hold : 0, gap = s ? s->gap : 0;
+    if (!hold && !gap) {
+      hold = htll_sites[i].hold;
+      gap = htll_sites[i].gap;
+    }
+    if (!hold && !gap)
+      continue;
+    locks[nlocks].module = htll_sites[i].module;
+    locks[nlocks].offset = htll_sites[i].offset;
+    locks[nlocks].hold = timebase_ticks_to_ns(hold);
+    locks[nlocks].gap = timebase_ticks_to_ns(gap);
+    nlocks++;
+  }
+  ebr_exit();
+  qsort(locks, nlocks, sizeof(*locks), htll_site_cmp);
+  /* Keep what was loaded for the locks not contended in this run */
+  uint32_t n = nlocks;
+  for (uint32_t i = 0; i < htll_nsaved_locks; i++)
+    if (!bsearch(&htll_saved_locks[i], locks, n, sizeof(*locks),
+                 htll_site_cmp))
+      locks[nlocks++] = htll_saved_locks[i];
+  qsort(locks, nlocks, sizeof(*locks), htll_site_cmp);
+
+  /* Written aside, then renamed over the previous file */
+  char tmp[PATH_MAX];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", htll_state_path) >=
+      (int)sizeof(tmp))
+    goto out;
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    goto out;
+  htll_state_header_t h = {HTLL_STATE_MAGIC, HTLL_STATE_VERSION, nsegs, nlocks,
+                           0};
+  int err = htll_state_write(fd, &h, sizeof(h)) ||
+            htll_state_write(fd, segs, nsegs * sizeof(*segs)) ||
+            htll_state_write(fd, locks, nlocks * sizeof(*locks));
+  close(fd);
+  if (err || rename(tmp, htll_state_path))
+    unlink(tmp);
+out:
+  free(segs);
+  free(locks);
+  __sync_lock_release(&htll_state_busy);
+}
@@ -32,150 +32,448 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
-
-#ifdef MCS
-#include <mcs.h>
-#elif defined(HTLL)
-#include <htll.h>
-#elif defined(PTHREADINTERPOSE)
-#include <pthreadinterpose.h>
-#else
-#error "No lock algorithm known"
-#endif
+#include <errno.h>
 
 #include "waiting_policy.h"
 #include "utils.h"
 #include "interpose.h"
+#include "locktable.h"
+#include "ebr.h"
+#include "slab.h"
+#include "tid.h"
+#include "timebase.h"
 
 // The NO_INDIRECTION flag allows disabling the pthread-to-lock hash table
 // and directly calling the specific lock function
 // See empty.c for example.
 
 unsigned int last_thread_id;
-__thread unsigned int cur_thread_id;
+__thread lp_thread_t *lp_self __attribute__((tls_model("initial-exec")));
 int spin_cnt = 0;
 int park_cnt = 0;
 int wake_cnt = 0;
 
 #if !NO_INDIRECTION
+// Read-only once published but for gen, so wrappers are packed together
 typedef struct {
 	lock_mutex_t *lock_lock;
-	char __pad0[pad_to_cache_line(sizeof(lock_mutex_t *))];
-
+	// Bumped when the wrapper is destroyed, to tell cached lookups of it
+	// apart from those of its next incarnations (not the first word, which
+	// the slab uses for its free list)
+	unsigned long gen;
 #if NEED_CONTEXT
-	lock_context_t lock_node[MAX_THREADS];
-	char __pad1[pad_to_cache_line(sizeof(lock_context_t) * MAX_THREADS)];
+	// Identifies this incarnation of the wrapper for the per-thread
+	// contexts (0 once freed)
+	unsigned long id;
 #endif
 }
 lock_transparent_mutex_t;
 
-/* ************** ONLY A NAIVE HASH IMPLMENTATION HERE ************* */
-// Since CLHT is not avalible in ARM, we use a very simple hash table
-// Can be replaced with other high-efficient HASH Table implementation
+#endif
+
+// Its destructor releases the thread's state and id, also on pthread_exit
+static pthread_key_t lp_exit_key;
+#define LP_EXIT_FIRST ((void *)1)
+#define LP_EXIT_LAST  ((void *)2)
+
+// Number of ids held by threads that attached again after their teardown
+// (see LP_EXITED and lp_thread_reclaim)
+static int lp_nlate;
+
+// With this flag enabled, the mutex_destroy function will be called on each
+// alive lock
+// at application exit (e.g., for printing statistics about a lock -- see
+// src/concurrency.c)
+#ifndef DESTROY_ON_EXIT
+#define DESTROY_ON_EXIT 0
+#endif
+
+// With this flag enabled, SIGINT and SIGTERM are caught to call the destructor
+// of the library (see interpose_exit below)
+#ifndef CLEANUP_ON_SIGNAL
+#define CLEANUP_ON_SIGNAL 0
+#endif
 
-#define BUCKET_SIZE     40960
-#define BUCKET_LENGTH   10
-uint64_t my_hash(void *key)
+// Set by the algorithms that implement the lock_rwlock_* functions themselves
+// (otherwise rwlocks are mapped to their mutex)
+#ifndef SUPPORT_RWLOCK
+#define SUPPORT_RWLOCK 0
+#endif
+
+// Same for lock_spin_* (otherwise spinlocks are left to the libc)
+#ifndef SUPPORT_SPINLOCK
+#define SUPPORT_SPINLOCK 0
+#endif
+
+// Set by the algorithms that take the expected critical section length as a
+// hint (lock_mutex_lock_hint)
+#ifndef SUPPORT_LOCK_HINT
+#define SUPPORT_LOCK_HINT 0
+#endif
+
+// Set by the algorithms that want to know the address of the pthread lock
+// behind a new lock object, and the code that initialized it (lock_mutex_bind)
+#ifndef SUPPORT_LOCK_BIND
+#define SUPPORT_LOCK_BIND 0
+#endif
+
+#if !NO_INDIRECTION && NEED_CONTEXT
+// Per-thread lock contexts, allocated the first time a thread uses a lock and
+// found through a small per-thread map keyed by the address of the wrapper's
+// id, so that a lock only costs a context for each thread that used it.
+// Entries of destroyed locks (whose id changed) are dropped when the map
+// grows; the wrappers come from a slab and are never unmapped, so reading a
+// stale id is safe.
+#define CTX_MAP_MIN 64
+
+struct ctx_entry {
+	unsigned long *idp;
+	unsigned long id;
+	lock_context_t *node;
+};
+
+typedef struct {
+	struct ctx_entry *slots;
+	unsigned long mask;
+	unsigned long used;
+	struct ctx_entry *last;
+} ctx_map_t;
+
+// In the block of the thread (lp_block_t)
+static inline ctx_map_t *lp_ctx_map(void);
+
+static slab_t ctx_slab = SLAB_INITIALIZER(sizeof(lock_context_t),
+					  __alignof__(lock_context_t));
+static unsigned long ctx_last_id;
+
+static inline unsigned long ctx_new_id(void)
 {
-	return (((uint64_t) key >> 4) + ((uint64_t) key >> 24)) & (BUCKET_SIZE -
-								   1);
+	return __atomic_add_fetch(&ctx_last_id, 1, __ATOMIC_RELAXED);
 }
 
-struct lock_table {
-	void *key;
-	void *value;
-};
-static struct lock_table pthread_lock_table[BUCKET_SIZE][BUCKET_LENGTH];
+static inline unsigned long ctx_hash(unsigned long *idp)
+{
+	return ((uintptr_t) idp * 0x9E3779B97F4A7C15ULL) >> 32;
+}
 
-int hash_put(void *mutex, void *impl)
+static void ctx_map_insert(ctx_map_t * m, struct ctx_entry *e)
 {
-	uint64_t cur_hash = my_hash(mutex);
+	unsigned long i = ctx_hash(e->idp) & m->mask;
 
-	for (int i = 0; i < BUCKET_LENGTH; i++) {
-		if (pthread_lock_table[cur_hash][i].key == 0) {
-			void *expected = 0;
-			if (__atomic_compare_exchange_n
-			    (&(pthread_lock_table[cur_hash][i].key), &expected,
-			     mutex, 0, __ATOMIC_ACQUIRE,
-			     __ATOMIC_ACQUIRE) == 1) {
-				pthread_lock_table[cur_hash][i].value = impl;
-				return 0;
-			}
-		}
-	}
-	return -1;
+	while (m->slots[i].idp)
+		i = (i + 1) & m->mask;
+	m->slots[i] = *e;
 }
 
-void *hash_get(void *mutex)
+static void ctx_map_resize(ctx_map_t * m)
 {
-	uint64_t cur_hash = my_hash(mutex);
+	struct ctx_entry *old = m->slots;
+	unsigned long old_size = old ? m->mask + 1 : 0;
+	unsigned long live = 0, size = CTX_MAP_MIN;
+
+	for (unsigned long i = 0; i < old_size; i++)
+		if (old[i].idp && *old[i].idp == old[i].id)
+			live++;
+	while (size < 4 * live)
+		size <<= 1;
+
+	m->slots = calloc(size, sizeof(struct ctx_entry));
+	if (!m->slots) {
+		fprintf(stderr, "Unable to allocate lock contexts (LitL)\n");
+		exit(-1);
+	}
+	m->mask = size - 1;
+	m->used = live;
+	m->last = NULL;
+	for (unsigned long i = 0; i < old_size; i++) {
+		if (!old[i].idp)
+			continue;
+		if (*old[i].idp == old[i].id)
+			ctx_map_insert(m, &old[i]);
+		else
+			slab_free(&ctx_slab, old[i].node);
+	}
+	free(old);
+}
 
-	for (int i = 0; i < BUCKET_LENGTH; i++) {
-		if (pthread_lock_table[cur_hash][i].key == mutex) {
-			while (pthread_lock_table[cur_hash][i].value == 0) {
-				asm volatile ("nop":::"memory");
+static lock_context_t *ctx_bind(ctx_map_t * m, unsigned long *idp, int *fresh)
+{
+	unsigned long id = *idp;
+
+	if (m->used >= (m->mask + 1) / 2)
+		ctx_map_resize(m);
+
+	for (unsigned long i = ctx_hash(idp) & m->mask;; i = (i + 1) & m->mask) {
+		struct ctx_entry *e = &m->slots[i];
+		if (e->idp == idp) {
+			// The address now holds another lock
+			if (e->id != id) {
+				e->id = id;
+				*fresh = 1;
 			}
-			return (void *)pthread_lock_table[cur_hash][i].value;
+			m->last = e;
+			return e->node;
+		}
+		if (e->idp == NULL) {
+			e->idp = idp;
+			e->id = id;
+			e->node = slab_alloc(&ctx_slab);
+			m->used++;
+			m->last = e;
+			*fresh = 1;
+			return e->node;
 		}
 	}
-	return NULL;
 }
 
-#endif
-
-struct routine {
-	void *(*fct)(void *);
-	void *arg;
-};
+static inline lock_context_t *ctx_get(unsigned long *idp, int *fresh)
+{
+	ctx_map_t *m = lp_ctx_map();
+	struct ctx_entry *e = m->last;
 
-// With this flag enabled, the mutex_destroy function will be called on each
-// alive lock
-// at application exit (e.g., for printing statistics about a lock -- see
-// src/concurrency.c)
-#ifndef DESTROY_ON_EXIT
-#define DESTROY_ON_EXIT 0
-#endif
+	*fresh = 0;
+	if (e && e->idp == idp && e->id == *idp)
+		return e->node;
+	return ctx_bind(m, idp, fresh);
+}
 
-// With this flag enabled, SIGINT and SIGTERM are caught to call the destructor
-// of the library (see interpose_exit below)
-#ifndef CLEANUP_ON_SIGNAL
-#define CLEANUP_ON_SIGNAL 0
+static void ctx_thread_exit(ctx_map_t * m)
+{
+	for (unsigned long i = 0; m->slots && i <= m->mask; i++)
+		if (m->slots[i].idp)
+			slab_free(&ctx_slab, m->slots[i].node);
+	free(m->slots);
+	memset(m, 0, sizeof(*m));
+}
 #endif
 
 #if !NO_INDIRECTION
 int lock_cnt;
+static slab_t ht_lock_slab = SLAB_INITIALIZER(sizeof(lock_transparent_mutex_t),
+					      __alignof__
+					      (lock_transparent_mutex_t));
+
+// site: return address of the pthread_*_init call, NULL for a lock
+// initialized statically
 static lock_transparent_mutex_t *ht_lock_create(pthread_mutex_t * mutex,
 						const pthread_mutexattr_t *
-						attr)
+						attr, const void *site)
 {
-	lock_transparent_mutex_t *impl = alloc_cache_align(sizeof *impl);
+	lock_transparent_mutex_t *impl = slab_alloc(&ht_lock_slab);
 	impl->lock_lock = lock_mutex_create(attr);
+#if SUPPORT_LOCK_BIND
+	lock_mutex_bind(impl->lock_lock, mutex, site);
+#else
+	(void)site;
+#endif
 #if NEED_CONTEXT
-	lock_init_context(impl->lock_lock, impl->lock_node, MAX_THREADS);
+	impl->id = ctx_new_id();
 #endif
 
 	// If a lock is initialized statically and two threads acquire the locks at
-	// the same time, then only one call to clht_put will succeed.
+	// the same time, then only one call to lock_table_put will succeed.
 	// For the failing thread, we free the previously allocated mutex data
-	// structure and do a lookup to retrieve the ones inserted by the successful
-	// thread.
-	if (hash_put(mutex, impl) == 0) {
-		return impl;
+	// structure and use the one inserted by the successful thread.
+	lock_transparent_mutex_t *cur = lock_table_put(mutex, impl);
+	if (cur != impl) {
+#if NEED_CONTEXT
+		impl->id = 0;
+#endif
+		lock_mutex_destroy(impl->lock_lock);
+		slab_free(&ht_lock_slab, impl);
 	}
-	printf("Hash Table FULL (LitL)\n");
-	exit(-1);
-	return NULL;
+	return cur;
 }
 
 static lock_transparent_mutex_t *ht_lock_get(pthread_mutex_t * mutex)
 {
 	lock_transparent_mutex_t *impl =
-	    (lock_transparent_mutex_t *) hash_get(mutex);
+	    (lock_transparent_mutex_t *) lock_table_get(mutex);
 	if (impl == NULL) {
-		impl = ht_lock_create(mutex, NULL);
+		impl = ht_lock_create(mutex, NULL, NULL);
 	}
 	return impl;
 }
+
+static inline lock_context_t *get_node(lock_transparent_mutex_t * impl)
+{
+#if NEED_CONTEXT
+	int fresh;
+	lock_context_t *node = ctx_get(&impl->id, &fresh);
+	if (fresh)
+		lock_init_context(impl->lock_lock, node, 1);
+	return node;
+#else
+	return NULL;
+#endif
+}
+
+// With this flag enabled, each thread keeps a small direct-mapped cache of
+// the mutex-to-lock entries it recently used, plus the stack of the locks it
+// currently holds, so that lock and unlock usually skip the lock table and
+// the lookup of the thread's context.
+#ifndef LOOKUP_CACHE
+#define LOOKUP_CACHE 1
+#endif
+
+#if LOOKUP_CACHE
+#define LOOKUP_CACHE_SIZE 64
+#define HELD_LOCKS_MAX    16
+
+struct lookup_entry {
+	void *key;
+	lock_transparent_mutex_t *impl;
+	lock_context_t *node;
+	// impl->gen when the entry was filled
+	unsigned long gen;
+};
+
+typedef struct {
+	int held_top;
+	struct lookup_entry held[HELD_LOCKS_MAX];
+	struct lookup_entry entries[LOOKUP_CACHE_SIZE];
+} lookup_cache_t;
+
+// In the block of the thread (lp_block_t)
+static inline lookup_cache_t *lp_lookup_cache(void);
+
+// An entry is valid as long as its wrapper was not destroyed since: the
+// address may then hold a new lock. Wrappers are type-stable, so the
+// generation of a freed one can still be read
+static inline int lookup_entry_valid(struct lookup_entry *e)
+{
+	return e->gen == __atomic_load_n(&e->impl->gen, __ATOMIC_ACQUIRE);
+}
+
+static inline lock_transparent_mutex_t *ht_lock_lookup(void *mutex,
+							lock_context_t ** node)
+{
+	lookup_cache_t *c = lp_lookup_cache();
+	struct lookup_entry *e =
+	    &c->entries[((uintptr_t) mutex >> 4) & (LOOKUP_CACHE_SIZE - 1)];
+
+	if (__builtin_expect(e->key == mutex && lookup_entry_valid(e), 1)) {
+		*node = e->node;
+		return e->impl;
+	}
+
+	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
+	e->key = mutex;
+	e->impl = impl;
+	e->gen = __atomic_load_n(&impl->gen, __ATOMIC_ACQUIRE);
+	e->node = *node = get_node(impl);
+	return impl;
+}
+
+static inline void ht_lock_held_push(void *mutex,
+				     lock_transparent_mutex_t * impl,
+				     lock_context_t * node)
+{
+	lookup_cache_t *c = lp_lookup_cache();
+
+	// If the stack is full, unlock falls back to the cache
+	if (c->held_top < HELD_LOCKS_MAX) {
+		c->held[c->held_top].key = mutex;
+		c->held[c->held_top].impl = impl;
+		c->held[c->held_top].node = node;
+		c->held[c->held_top].gen = impl->gen;
+		c->held_top++;
+	}
+}
+
+static inline lock_transparent_mutex_t *ht_lock_held_pop(void *mutex,
+							 lock_context_t ** node)
+{
+	lookup_cache_t *c = lp_lookup_cache();
+
+	// Locks are almost always released in LIFO order
+	for (int i = c->held_top - 1; i >= 0; i--) {
+		if (c->held[i].key == mutex) {
+			struct lookup_entry e = c->held[i];
+			c->held_top--;
+			for (; i < c->held_top; i++)
+				c->held[i] = c->held[i + 1];
+			if (!lookup_entry_valid(&e))
+				break;
+			*node = e.node;
+			return e.impl;
+		}
+	}
+	return ht_lock_lookup(mutex, node);
+}
+
+static inline void ht_lock_invalidate(lock_transparent_mutex_t * impl)
+{
+	__atomic_add_fetch(&impl->gen, 1, __ATOMIC_RELEASE);
+}
+#else
+static inline lock_transparent_mutex_t *ht_lock_lookup(void *mutex,
+							lock_context_t ** node)
+{
+	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
+	*node = get_node(impl);
+	return impl;
+}
+
+#define ht_lock_held_push(mutex, impl, node) do { } while (0)
+#define ht_lock_held_pop(mutex, node)        ht_lock_lookup(mutex, node)
+#define ht_lock_invalidate(impl)             do { } while (0)
+#endif
+
+static void ht_lock_free(void *p)
+{
+	lock_transparent_mutex_t *impl = p;
+#if NEED_CONTEXT
+	impl->id = 0;
+#endif
+	lock_mutex_destroy(impl->lock_lock);
+	slab_free(&ht_lock_slab, impl);
+}
+
+// Lookups and unlocks that started before the removal may still use the
+// lock: it is only released once they are all over
+static void ht_lock_destroy(void *mutex)
+{
+	lock_transparent_mutex_t *impl = lock_table_remove(mutex);
+	if (impl != NULL) {
+		ht_lock_invalidate(impl);
+		ebr_retire(impl, ht_lock_free);
+	}
+}
+#endif
+
+// Block of a thread along with the per-thread state of this file, so that
+// the lock path reaches all of it from the one lp_self load
+typedef struct {
+	lp_thread_t t;
+#if !NO_INDIRECTION && NEED_CONTEXT
+	ctx_map_t ctx_map;
+#endif
+#if !NO_INDIRECTION && LOOKUP_CACHE
+	lookup_cache_t lookup_cache;
+#endif
+} lp_block_t;
+
+// Indexed by thread id
+static lp_block_t lp_threads[MAX_THREADS];
+
+static inline lp_block_t *lp_block(void)
+{
+	return (lp_block_t *) lp_thread();
+}
+
+#if !NO_INDIRECTION && NEED_CONTEXT
+static inline ctx_map_t *lp_ctx_map(void)
+{
+	return &lp_block()->ctx_map;
+}
+#endif
+
+#if !NO_INDIRECTION && LOOKUP_CACHE
+static inline lookup_cache_t *lp_lookup_cache(void)
+{
+	return &lp_block()->lookup_cache;
+}
 #endif
 
 int (*REAL(pthread_mutex_init))(pthread_mutex_t * mutex,
@@ -188,6 +486,10 @@ int (*REAL(pthread_mutex_lock))(pthread_mutex_t * mutex)
 int (*REAL(pthread_mutex_timedlock))(pthread_mutex_t * mutex,
 				     const struct timespec * abstime)
     __attribute__((aligned(L_CACHE_LINE_SIZE)));
+int (*REAL(pthread_mutex_clocklock))(pthread_mutex_t * mutex,
+				     clockid_t clockid,
+				     const struct timespec * abstime)
+    __attribute__((aligned(L_CACHE_LINE_SIZE)));
 int (*REAL(pthread_mutex_trylock))(pthread_mutex_t * mutex)
     __attribute__((aligned(L_CACHE_LINE_SIZE)));
 int (*REAL(pthread_mutex_unlock))(pthread_mutex_t * mutex)
@@ -250,6 +552,99 @@ int (*REAL(pthread_rwlock_unlock))(pthread_rwlock_t * lock)
 static void signal_exit(int signo);
 #endif
 
+static void lp_thread_exit(void *state)
+{
+	lp_block_t *b = (lp_block_t *) lp_self;
+	lp_thread_t *t = &b->t;
+
+	// Let the other destructors of the thread run first: they may still
+	// take locks
+	if (state == LP_EXIT_FIRST) {
+		pthread_setspecific(lp_exit_key, LP_EXIT_LAST);
+		return;
+	}
+
+	lock_thread_exit();
+#if !NO_INDIRECTION && NEED_CONTEXT
+	ctx_thread_exit(&b->ctx_map);
+#endif
+#if !NO_INDIRECTION && LOOKUP_CACHE
+	// The block goes to the next thread that gets the id
+	memset(&b->lookup_cache, 0, sizeof(b->lookup_cache));
+#endif
+	ebr_thread_exit();
+	lp_self = LP_EXITED;
+	if (t->late) {
+		t->late = 0;
+		__atomic_sub_fetch(&lp_nlate, 1, __ATOMIC_RELAXED);
+	}
+	tid_free(t->id);
+}
+
+// Release the ids of the threads that attached again after their teardown
+// and are gone since. The kernel does not reuse a thread id while its thread
+// runs, so one that is not found anymore has exited
+static void lp_thread_reclaim(void)
+{
+	pid_t pid = getpid();
+	unsigned int n = __atomic_load_n(&last_thread_id, __ATOMIC_RELAXED);
+
+	for (unsigned int id = 0; id < n; id++) {
+		pid_t tid = __atomic_load_n(&lp_threads[id].t.late,
+					    __ATOMIC_RELAXED);
+		if (!tid || syscall(SYS_tgkill, pid, tid, 0) == 0
+		    || errno != ESRCH)
+			continue;
+		if (__atomic_compare_exchange_n(&lp_threads[id].t.late, &tid, 0,
+						0, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			__atomic_sub_fetch(&lp_nlate, 1, __ATOMIC_RELAXED);
+			tid_free(id);
+		}
+	}
+}
+
+static int lp_tid_alloc(void)
+{
+	if (__atomic_load_n(&lp_nlate, __ATOMIC_RELAXED))
+		lp_thread_reclaim();
+	return tid_alloc();
+}
+
+static void lp_thread_bind(lp_thread_t * t)
+{
+	lp_self = t;
+	t->late = 0;
+	pthread_setspecific(lp_exit_key, LP_EXIT_FIRST);
+#if !NO_INDIRECTION
+	// clht_gc_thread_init(pthread_to_lock, t->id);
+#endif
+	lock_thread_start();
+}
+
+lp_thread_t *lp_thread_attach(void)
+{
+	int id = lp_tid_alloc();
+
+	if (id < 0) {
+		fprintf(stderr,
+			"Maximum number of threads reached. Consider raising "
+			"MAX_THREADS in utils.h (current = %u)\n", MAX_THREADS);
+		exit(-1);
+	}
+	lp_thread_t *t = &lp_threads[id].t;
+	int exited = lp_self == LP_EXITED;
+
+	t->id = id;
+	lp_thread_bind(t);
+	if (exited) {
+		// Past the last destructor round, the id would never be freed
+		t->late = syscall(SYS_gettid);
+		__atomic_add_fetch(&lp_nlate, 1, __ATOMIC_RELAXED);
+	}
+	return t;
+}
+
 volatile uint8_t init_spinlock = 0;
 
 static void __attribute__((constructor)) REAL(interpose_init) (void) {
@@ -272,24 +667,13 @@ static void __attribute__((constructor)) REAL(interpose_init) (void) {
 	}
 
 	// printf("Using Lib%s with waiting %s\n", LOCK_ALGORITHM, WAITING_POLICY);
-#if !NO_INDIRECTION
-	// pthread_to_lock = clht_create(NUM_BUCKETS);
-	memset(pthread_lock_table, 0,
-	       sizeof(struct lock_table) * BUCKET_SIZE * BUCKET_LENGTH);
-	// assert(pthread_to_lock != NULL);
-#endif
+	// The lock table is allocated lazily, on the first lock creation.
+
+	timebase_init();
 
 	// The main thread should also have an ID
-	cur_thread_id = __sync_fetch_and_add(&last_thread_id, 1);
-	if (cur_thread_id >= MAX_THREADS) {
-		fprintf(stderr,
-			"Maximum number of threads reached. Consider raising "
-			"MAX_THREADS in interpose.c\n");
-		exit(-1);
-	}
-#if !NO_INDIRECTION
-	// clht_gc_thread_init(pthread_to_lock, cur_thread_id);
-#endif
+	pthread_key_create(&lp_exit_key, lp_thread_exit);
+	lp_thread_attach();
 
 	lock_application_init();
 
@@ -312,6 +696,7 @@ static void __attribute__((constructor)) REAL(interpose_init) (void) {
 	LOAD_FUNC(pthread_mutex_destroy, 1, FCT_LINK_SUFFIX);
 	LOAD_FUNC(pthread_mutex_lock, 1, FCT_LINK_SUFFIX);
 	LOAD_FUNC(pthread_mutex_timedlock, 1, FCT_LINK_SUFFIX);
+	LOAD_FUNC(pthread_mutex_clocklock, 1, FCT_LINK_SUFFIX);
 	LOAD_FUNC(pthread_mutex_trylock, 1, FCT_LINK_SUFFIX);
 	LOAD_FUNC(pthread_mutex_unlock, 1, FCT_LINK_SUFFIX);
 	LOAD_FUNC(pthread_cond_timedwait, 1, FCT_LINK_SUFFIX);
@@ -342,20 +727,12 @@ static void __attribute__((constructor)) REAL(interpose_init) (void) {
 }
 
 static void __attribute__((destructor)) REAL(interpose_exit) (void) {
+	if (spin_cnt || park_cnt || wake_cnt)
+		fprintf(stderr, "spin %d park %d wake %d\n", spin_cnt, park_cnt,
+			wake_cnt);
 	lock_application_exit();
 }
 
-#if !NO_INDIRECTION
-static inline lock_context_t *get_node(lock_transparent_mutex_t * impl)
-{
-#if NEED_CONTEXT
-	return &impl->lock_node[cur_thread_id];
-#else
-	return NULL;
-#endif
-};
-#endif
-
 #if CLEANUP_ON_SIGNAL
 static void signal_exit(int UNUSED(signo))
 {
@@ -366,39 +743,48 @@ static void signal_exit(int UNUSED(signo))
 
 static void *lp_start_routine(void *_arg)
 {
-	struct routine *r = _arg;
-	void *(*fct)(void *) = r->fct;
-	void *arg = r->arg;
-	void *res;
-
-	// free(r);
+	lp_thread_t *t = _arg;
 
-	cur_thread_id = __sync_fetch_and_add(&last_thread_id, 1);
+	lp_thread_bind(t);
+	return t->fct(t->arg);
+}
 
-	if (cur_thread_id >= MAX_THREADS) {
-		fprintf(stderr,
-			"Maximum number of threads reached. Consider raising "
-			"MAX_THREADS in interpose.c (current = %u)\n",
-			MAX_THREADS);
-		exit(-1);
+static int lp_create(pthread_t * thread, const pthread_attr_t * attr,
+		     void *(*start_routine)(void *), void *arg)
+{
+	if (init_spinlock != 2) {
+		REAL(interpose_init) ();
 	}
-#if !NO_INDIRECTION
-	// clht_gc_thread_init(pthread_to_lock, cur_thread_id);
-#endif
-	lock_thread_start();
-	res = fct(arg);
-	lock_thread_exit();
-	return res;
+
+	int id = lp_tid_alloc();
+	if (id < 0)
+		return EAGAIN;
+
+	lp_thread_t *t = &lp_threads[id].t;
+	t->id = id;
+	t->fct = start_routine;
+	t->arg = arg;
+	int ret = REAL(pthread_create) (thread, attr, lp_start_routine, t);
+	if (ret != 0)
+		tid_free(id);
+	return ret;
 }
 
 int pthread_create(pthread_t * thread, const pthread_attr_t * attr,
 		   void *(*start_routine)(void *), void *arg)
 {
 	DEBUG_PTHREAD("[p] pthread_create\n");
-	struct routine *r = malloc(sizeof(struct routine));
-	r->fct = start_routine;
-	r->arg = arg;
-	return REAL(pthread_create) (thread, attr, lp_start_routine, r);
+	return lp_create(thread, attr, start_routine, arg);
+}
+
+// Binaries linked against glibc 2.34 or later reference this version of
+// pthread_create: without it, the threads they create get no thread id
+__asm__(".symver pthread_create_2_34,pthread_create@GLIBC_2.34");
+int pthread_create_2_34(pthread_t * thread, const pthread_attr_t * attr,
+			void *(*start_routine)(void *), void *arg)
+{
+	DEBUG_PTHREAD("[p] pthread_create@GLIBC_2.34\n");
+	return lp_create(thread, attr, start_routine, arg);
 }
 
 int pthread_mutex_init(pthread_mutex_t * mutex,
@@ -408,10 +794,18 @@ int pthread_mutex_init(pthread_mutex_t * mutex,
 	// if (unlikely(!pthread_to_lock))
 	// REAL(interpose_init)();
 #if !NO_INDIRECTION
-	ht_lock_create(mutex, attr);
+	// The address may still map to a mutex that was freed without being
+	// destroyed: retire it rather than inheriting its state
+	ht_lock_destroy(mutex);
+	ht_lock_create(mutex, attr, __builtin_return_address(0));
 	return 0;
 #else
-	return REAL(pthread_mutex_init) (mutex, attr);
+	int ret = REAL(pthread_mutex_init) (mutex, attr);
+#if SUPPORT_LOCK_BIND
+	lock_mutex_bind((lock_mutex_t *) mutex, mutex,
+			__builtin_return_address(0));
+#endif
+	return ret;
 #endif
 }
 
@@ -419,10 +813,10 @@ int pthread_mutex_destroy(pthread_mutex_t * mutex)
 {
 	DEBUG_PTHREAD("[p] pthread_mutex_destroy\n");
 #if !NO_INDIRECTION
-	printf("spin %d park %d wake %d\n", spin_cnt, park_cnt, wake_cnt);
-    return 0; /* Not impl */
+	ht_lock_destroy(mutex);
+	return 0;
 #else
-	return lock_mutex_destroy(mutex);
+	return lock_mutex_destroy((lock_mutex_t *) mutex);
 #endif
 }
 
@@ -430,27 +824,76 @@ int pthread_mutex_lock(pthread_mutex_t * mutex)
 {
 	DEBUG_PTHREAD("[p] pthread_mutex_lock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-	return lock_mutex_lock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup(mutex, &node);
+	int ret = lock_mutex_lock(impl->lock_lock, node);
+	ht_lock_held_push(mutex, impl, node);
+	return ret;
+#else
+	return lock_mutex_lock((lock_mutex_t *) mutex, NULL);
+#endif
+}
+
+#if SUPPORT_LOCK_HINT
+// pthread_mutex_lock for callers that know how long they will hold the lock
+int htll_mutex_lock_hint(pthread_mutex_t * mutex, uint64_t expected_cs_ns)
+{
+	DEBUG_PTHREAD("[p] htll_mutex_lock_hint\n");
+#if !NO_INDIRECTION
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup(mutex, &node);
+	int ret = lock_mutex_lock_hint(impl->lock_lock, node, expected_cs_ns);
+	ht_lock_held_push(mutex, impl, node);
+	return ret;
+#else
+	return lock_mutex_lock_hint((lock_mutex_t *) mutex, NULL,
+				    expected_cs_ns);
+#endif
+}
+#endif
+
+static int lp_mutex_timedlock(void *mutex, clockid_t clock,
+			      const struct timespec *abstime)
+{
+#if !NO_INDIRECTION
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup(mutex, &node);
+	int ret = lock_mutex_timedlock(impl->lock_lock, node, clock, abstime);
+	if (ret == 0)
+		ht_lock_held_push(mutex, impl, node);
+	return ret;
 #else
-	return lock_mutex_lock(mutex, NULL);
+	return lock_mutex_timedlock((lock_mutex_t *) mutex, NULL, clock,
+				    abstime);
 #endif
 }
 
 int pthread_mutex_timedlock(pthread_mutex_t * mutex,
 			    const struct timespec *abstime)
 {
-	assert(0 && "Timed locks not supported");
+	DEBUG_PTHREAD("[p] pthread_mutex_timedlock\n");
+	return lp_mutex_timedlock(mutex, CLOCK_REALTIME, abstime);
+}
+
+int pthread_mutex_clocklock(pthread_mutex_t * mutex, clockid_t clockid,
+			    const struct timespec *abstime)
+{
+	DEBUG_PTHREAD("[p] pthread_mutex_clocklock\n");
+	return lp_mutex_timedlock(mutex, clockid, abstime);
 }
 
 int pthread_mutex_trylock(pthread_mutex_t * mutex)
 {
 	DEBUG_PTHREAD("[p] pthread_mutex_trylock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-	return lock_mutex_trylock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup(mutex, &node);
+	int ret = lock_mutex_trylock(impl->lock_lock, node);
+	if (ret == 0)
+		ht_lock_held_push(mutex, impl, node);
+	return ret;
 #else
-	return lock_mutex_trylock(mutex, NULL);
+	return lock_mutex_trylock((lock_mutex_t *) mutex, NULL);
 #endif
 }
 
@@ -458,11 +901,12 @@ int pthread_mutex_unlock(pthread_mutex_t * mutex)
 {
 	DEBUG_PTHREAD("[p] pthread_mutex_unlock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-	lock_mutex_unlock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_held_pop(mutex, &node);
+	lock_mutex_unlock(impl->lock_lock, node);
 	return 0;
 #else
-	lock_mutex_unlock(mutex, NULL);
+	lock_mutex_unlock((lock_mutex_t *) mutex, NULL);
 	return 0;
 #endif
 }
@@ -470,7 +914,7 @@ int pthread_mutex_unlock(pthread_mutex_t * mutex)
 int pthread_cond_init(pthread_cond_t * cond, const pthread_condattr_t * attr)
 {
 	DEBUG_PTHREAD("[p] pthread_cond_init\n");
-	return lock_cond_init(cond, attr);
+	return lock_cond_init((lock_cond_t *) cond, attr);
 }
 
 // __asm__(".symver __pthread_cond_init,pthread_cond_init@@" GLIBC_2_3_2);
@@ -478,7 +922,7 @@ int pthread_cond_init(pthread_cond_t * cond, const pthread_condattr_t * attr)
 int pthread_cond_destroy(pthread_cond_t * cond)
 {
 	DEBUG_PTHREAD("[p] pthread_cond_destroy\n");
-	return lock_cond_destroy(cond);
+	return lock_cond_destroy((lock_cond_t *) cond);
 }
 
 // __asm__(".symver __pthread_cond_destroy,pthread_cond_destroy@@" GLIBC_2_3_2);
@@ -488,11 +932,13 @@ int pthread_cond_timedwait(pthread_cond_t * cond, pthread_mutex_t * mutex,
 {
 	DEBUG_PTHREAD("[p] pthread_cond_timedwait\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-	return lock_cond_timedwait(cond, impl->lock_lock, get_node(impl),
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup(mutex, &node);
+	return lock_cond_timedwait((lock_cond_t *) cond, impl->lock_lock, node,
 				   abstime);
 #else
-	return lock_cond_timedwait(cond, mutex, NULL, abstime);
+	return lock_cond_timedwait((lock_cond_t *) cond,
+				   (lock_mutex_t *) mutex, NULL, abstime);
 #endif
 }
 
@@ -503,10 +949,12 @@ int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex)
 {
 	DEBUG_PTHREAD("[p] pthread_cond_wait\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get(mutex);
-	return lock_cond_wait(cond, impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup(mutex, &node);
+	return lock_cond_wait((lock_cond_t *) cond, impl->lock_lock, node);
 #else
-	return lock_cond_wait(cond, mutex, NULL);
+	return lock_cond_wait((lock_cond_t *) cond, (lock_mutex_t *) mutex,
+			      NULL);
 #endif
 }
 
@@ -515,7 +963,7 @@ int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex)
 int pthread_cond_signal(pthread_cond_t * cond)
 {
 	DEBUG_PTHREAD("[p] pthread_cond_signal\n");
-	return lock_cond_signal(cond);
+	return lock_cond_signal((lock_cond_t *) cond);
 }
 
 // __asm__(".symver __pthread_cond_signal,pthread_cond_signal@@" GLIBC_2_3_2);
@@ -523,110 +971,106 @@ int pthread_cond_signal(pthread_cond_t * cond)
 int pthread_cond_broadcast(pthread_cond_t * cond)
 {
 	DEBUG_PTHREAD("[p] pthread_cond_broadcast\n");
-	return lock_cond_broadcast(cond);
+	return lock_cond_broadcast((lock_cond_t *) cond);
 }
 
 // __asm__(".symver __pthread_cond_broadcast,pthread_cond_broadcast@@"
 // GLIBC_2_3_2);
 
-// // Spinlocks
-// int pthread_spin_init(pthread_spinlock_t * spin, int pshared)
-// {
-// 	DEBUG_PTHREAD("[p] pthread_spin_init\n");
-// 	if (init_spinlock != 2) {
-// 		REAL(interpose_init) ();
-// 	}
-// #if !NO_INDIRECTION
-// 	ht_lock_create((void *)spin, NULL);
-// 	return 0;
-// #else
-// 	return REAL(pthread_spin_init) (spin, pshared);
-// #endif
-// }
-
-// int pthread_spin_destroy(pthread_spinlock_t * spin)
-// {
-// 	DEBUG_PTHREAD("[p] pthread_spin_destroy\n");
-// #if !NO_INDIRECTION
-// 	return 0;
-// #else
-// 	assert(0 && "spinlock not supported without indirection");
-// #endif
-// }
-
-// int pthread_spin_lock(pthread_spinlock_t * spin)
-// {
-// 	DEBUG_PTHREAD("[p] pthread_spin_lock\n");
-// #if !NO_INDIRECTION
-// 	lock_transparent_mutex_t *impl = ht_lock_get((void *)spin);
-// 	return lock_mutex_lock(impl->lock_lock, get_node(impl));
-// #else
-// 	assert(0 && "spinlock not supported without indirection");
-// #endif
-// }
-
-// int pthread_spin_trylock(pthread_spinlock_t * spin)
-// {
-// 	DEBUG_PTHREAD("[p] pthread_spin_trylock\n");
-// #if !NO_INDIRECTION
-// 	lock_transparent_mutex_t *impl = ht_lock_get((void *)spin);
-// 	return lock_mutex_trylock(impl->lock_lock, get_node(impl));
-// #else
-// 	assert(0 && "spinlock not supported without indirection");
-// #endif
-// }
-
-// int pthread_spin_unlock(pthread_spinlock_t * spin)
-// {
-// 	DEBUG_PTHREAD("[p] pthread_spin_unlock\n");
-// #if !NO_INDIRECTION
-// 	lock_transparent_mutex_t *impl = ht_lock_get((void *)spin);
-// 	lock_mutex_unlock(impl->lock_lock, get_node(impl));
-// 	return 0;
-// #else
-// 	assert(0 && "spinlock not supported without indirection");
-// #endif
-// }
-
-#if defined(RWTAS)
+#if SUPPORT_SPINLOCK
+// Spinlocks live inside pthread_spinlock_t: no lock table lookup
+int pthread_spin_init(pthread_spinlock_t * spin, int pshared)
+{
+	DEBUG_PTHREAD("[p] pthread_spin_init\n");
+	return lock_spin_init((lock_spinlock_t *) spin, pshared);
+}
+
+int pthread_spin_destroy(pthread_spinlock_t * spin)
+{
+	DEBUG_PTHREAD("[p] pthread_spin_destroy\n");
+	return lock_spin_destroy((lock_spinlock_t *) spin);
+}
+
+int pthread_spin_lock(pthread_spinlock_t * spin)
+{
+	DEBUG_PTHREAD("[p] pthread_spin_lock\n");
+	return lock_spin_lock((lock_spinlock_t *) spin);
+}
+
+int pthread_spin_trylock(pthread_spinlock_t * spin)
+{
+	DEBUG_PTHREAD("[p] pthread_spin_trylock\n");
+	return lock_spin_trylock((lock_spinlock_t *) spin);
+}
+
+int pthread_spin_unlock(pthread_spinlock_t * spin)
+{
+	DEBUG_PTHREAD("[p] pthread_spin_unlock\n");
+	return lock_spin_unlock((lock_spinlock_t *) spin);
+}
+#endif
+
+#if defined(RWTAS) || SUPPORT_RWLOCK
 
 #if !NO_INDIRECTION
 typedef struct {
 	lock_rwlock_t *lock_lock;
-	char __pad[pad_to_cache_line(sizeof(lock_rwlock_t *))];
 #if NEED_CONTEXT
-	lock_context_t lock_node[MAX_THREADS];
+	unsigned long id;
 #endif
 }
 lock_transparent_rwlock_t;
 
+static slab_t ht_rwlock_slab =
+    SLAB_INITIALIZER(sizeof(lock_transparent_rwlock_t),
+		     __alignof__(lock_transparent_rwlock_t));
+
 static lock_transparent_rwlock_t *ht_rwlock_create(pthread_rwlock_t * rwlock,
 						   const pthread_rwlockattr_t *
 						   attr)
 {
-	lock_transparent_rwlock_t *impl = alloc_cache_align(sizeof *impl);
+	lock_transparent_rwlock_t *impl = slab_alloc(&ht_rwlock_slab);
 	impl->lock_lock = lock_rwlock_create(attr);
 #if NEED_CONTEXT
-	lock_init_context(impl->lock_lock, impl->lock_node, MAX_THREADS);
+	impl->id = ctx_new_id();
 #endif
 
 	// If a lock is initialized statically and two threads acquire the locks at
-	// the same time, then only one call to clht_put will succeed.
+	// the same time, then only one call to lock_table_put will succeed.
 	// For the failing thread, we free the previously allocated mutex data
-	// structure and do a lookup to retrieve the ones inserted by the successful
-	// thread.
-	if (hash_put(rwlock, impl) == 0) {
-		return impl;
+	// structure and use the one inserted by the successful thread.
+	lock_transparent_rwlock_t *cur = lock_table_put(rwlock, impl);
+	if (cur != impl) {
+#if NEED_CONTEXT
+		impl->id = 0;
+#endif
+		lock_rwlock_destroy(impl->lock_lock);
+		slab_free(&ht_rwlock_slab, impl);
 	}
-	printf("Hash Table FULL (LitL)\n");
-	exit(-1);
-	return NULL;
+	return cur;
+}
+
+static void ht_rwlock_free(void *p)
+{
+	lock_transparent_rwlock_t *impl = p;
+#if NEED_CONTEXT
+	impl->id = 0;
+#endif
+	lock_rwlock_destroy(impl->lock_lock);
+	slab_free(&ht_rwlock_slab, impl);
+}
+
+static void ht_rwlock_destroy(void *rwlock)
+{
+	lock_transparent_rwlock_t *impl = lock_table_remove(rwlock);
+	if (impl != NULL)
+		ebr_retire(impl, ht_rwlock_free);
 }
 
 static lock_transparent_rwlock_t *ht_rwlock_get(pthread_rwlock_t * rwlock)
 {
 	lock_transparent_rwlock_t *impl =
-	    (lock_transparent_rwlock_t *) hash_get(rwlock);
+	    (lock_transparent_rwlock_t *) lock_table_get(rwlock);
 	if (impl == NULL) {
 		impl = ht_rwlock_create(rwlock, NULL);
 	}
@@ -637,7 +1081,11 @@ static lock_transparent_rwlock_t *ht_rwlock_get(pthread_rwlock_t * rwlock)
 static inline lock_context_t *get_rwlock_node(lock_transparent_rwlock_t * impl)
 {
 #if NEED_CONTEXT
-	return &impl->lock_node[cur_thread_id];
+	int fresh;
+	lock_context_t *node = ctx_get(&impl->id, &fresh);
+	if (fresh)
+		lock_init_context(impl->lock_lock, node, 1);
+	return node;
 #else
 	return NULL;
 #endif
@@ -653,6 +1101,8 @@ int pthread_rwlock_init(pthread_rwlock_t * rwlock,
 	}
 
 #if !NO_INDIRECTION
+	// Same as pthread_mutex_init: drop a stale mapping of the address
+	ht_rwlock_destroy(rwlock);
 	ht_rwlock_create((void *)rwlock, NULL);
 	return 0;
 #else
@@ -664,11 +1114,7 @@ int pthread_rwlock_destroy(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_destroy\n");
 #if !NO_INDIRECTION
-	lock_transparent_rwlock_t *impl = hash_get(rwlock);
-	if (impl != NULL) {
-		lock_rwlock_destroy(impl->lock_lock);
-		free(impl);
-	}
+	ht_rwlock_destroy(rwlock);
 	return 0;
 #else
 	assert(0 && "rwlock not supported without indirection");
@@ -701,16 +1147,46 @@ int pthread_rwlock_wrlock(pthread_rwlock_t * rwlock)
 	return ret;
 }
 
-int pthread_rwlock_timedrdlock(pthread_rwlock_t * lcok,
+int pthread_rwlock_clockrdlock(pthread_rwlock_t * rwlock, clockid_t clockid,
 			       const struct timespec *abstime)
 {
-	assert(0 && "Timed locks not supported");
+	int ret;
+	DEBUG_PTHREAD("[p] pthread_rwlock_clockrdlock\n");
+#if !NO_INDIRECTION
+	lock_transparent_rwlock_t *impl = ht_rwlock_get((void *)rwlock);
+	ret = lock_rwlock_timedrdlock(impl->lock_lock, get_rwlock_node(impl),
+				      clockid, abstime);
+#else
+	assert(0 && "rwlock not supported without indirection");
+#endif
+	return ret;
+}
+
+int pthread_rwlock_clockwrlock(pthread_rwlock_t * rwlock, clockid_t clockid,
+			       const struct timespec *abstime)
+{
+	int ret;
+	DEBUG_PTHREAD("[p] pthread_rwlock_clockwrlock\n");
+#if !NO_INDIRECTION
+	lock_transparent_rwlock_t *impl = ht_rwlock_get((void *)rwlock);
+	ret = lock_rwlock_timedwrlock(impl->lock_lock, get_rwlock_node(impl),
+				      clockid, abstime);
+#else
+	assert(0 && "rwlock not supported without indirection");
+#endif
+	return ret;
+}
+
+int pthread_rwlock_timedrdlock(pthread_rwlock_t * rwlock,
+			       const struct timespec *abstime)
+{
+	return pthread_rwlock_clockrdlock(rwlock, CLOCK_REALTIME, abstime);
 }
 
-int pthread_rwlock_timedwrlock(pthread_rwlock_t * lock,
+int pthread_rwlock_timedwrlock(pthread_rwlock_t * rwlock,
 			       const struct timespec *abstime)
 {
-	assert(0 && "Timed locks not supported");
+	return pthread_rwlock_clockwrlock(rwlock, CLOCK_REALTIME, abstime);
 }
 
 int pthread_rwlock_tryrdlock(pthread_rwlock_t * rwlock)
@@ -762,7 +1238,9 @@ int pthread_rwlock_init(pthread_rwlock_t * rwlock,
 		REAL(interpose_init) ();
 	}
 #if !NO_INDIRECTION
-	ht_lock_create((void *)rwlock, NULL);
+	// Same as pthread_mutex_init: drop a stale mapping of the address
+	ht_lock_destroy(rwlock);
+	ht_lock_create((void *)rwlock, NULL, __builtin_return_address(0));
 	return 0;
 #else
 	return REAL(pthread_rwlock_init) (rwlock, attr);
@@ -773,9 +1251,10 @@ int pthread_rwlock_destroy(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_destroy\n");
 #if !NO_INDIRECTION
+	ht_lock_destroy(rwlock);
 	return 0;
 #else
-	assert(0 && "rwlock not supported without indirection");
+	return lock_mutex_destroy((lock_mutex_t *) rwlock);
 #endif
 }
 
@@ -783,10 +1262,13 @@ int pthread_rwlock_rdlock(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_rdlock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get((void *)rwlock);
-	return lock_mutex_lock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup((void *)rwlock, &node);
+	int ret = lock_mutex_lock(impl->lock_lock, node);
+	ht_lock_held_push((void *)rwlock, impl, node);
+	return ret;
 #else
-	assert(0 && "rwlock not supported without indirection");
+	return lock_mutex_lock((lock_mutex_t *) rwlock, NULL);
 #endif
 }
 
@@ -794,33 +1276,56 @@ int pthread_rwlock_wrlock(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_wrlock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get((void *)rwlock);
-	return lock_mutex_lock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup((void *)rwlock, &node);
+	int ret = lock_mutex_lock(impl->lock_lock, node);
+	ht_lock_held_push((void *)rwlock, impl, node);
+	return ret;
 #else
-	assert(0 && "rwlock not supported without indirection");
+	return lock_mutex_lock((lock_mutex_t *) rwlock, NULL);
 #endif
 }
 
-int pthread_rwlock_timedrdlock(pthread_rwlock_t * lcok,
+int pthread_rwlock_timedrdlock(pthread_rwlock_t * rwlock,
+			       const struct timespec *abstime)
+{
+	DEBUG_PTHREAD("[p] pthread_rwlock_timedrdlock\n");
+	return lp_mutex_timedlock((void *)rwlock, CLOCK_REALTIME, abstime);
+}
+
+int pthread_rwlock_timedwrlock(pthread_rwlock_t * rwlock,
 			       const struct timespec *abstime)
 {
-	assert(0 && "Timed locks not supported");
+	DEBUG_PTHREAD("[p] pthread_rwlock_timedwrlock\n");
+	return lp_mutex_timedlock((void *)rwlock, CLOCK_REALTIME, abstime);
 }
 
-int pthread_rwlock_timedwrlock(pthread_rwlock_t * lock,
+int pthread_rwlock_clockrdlock(pthread_rwlock_t * rwlock, clockid_t clockid,
 			       const struct timespec *abstime)
 {
-	assert(0 && "Timed locks not supported");
+	DEBUG_PTHREAD("[p] pthread_rwlock_clockrdlock\n");
+	return lp_mutex_timedlock((void *)rwlock, clockid, abstime);
+}
+
+int pthread_rwlock_clockwrlock(pthread_rwlock_t * rwlock, clockid_t clockid,
+			       const struct timespec *abstime)
+{
+	DEBUG_PTHREAD("[p] pthread_rwlock_clockwrlock\n");
+	return lp_mutex_timedlock((void *)rwlock, clockid, abstime);
 }
 
 int pthread_rwlock_tryrdlock(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_trylock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get((void *)rwlock);
-	return lock_mutex_trylock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup((void *)rwlock, &node);
+	int ret = lock_mutex_trylock(impl->lock_lock, node);
+	if (ret == 0)
+		ht_lock_held_push((void *)rwlock, impl, node);
+	return ret;
 #else
-	assert(0 && "rwlock not supported without indirection");
+	return lock_mutex_trylock((lock_mutex_t *) rwlock, NULL);
 #endif
 }
 
@@ -828,10 +1333,14 @@ int pthread_rwlock_trywrlock(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_trylock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get((void *)rwlock);
-	return lock_mutex_trylock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl = ht_lock_lookup((void *)rwlock, &node);
+	int ret = lock_mutex_trylock(impl->lock_lock, node);
+	if (ret == 0)
+		ht_lock_held_push((void *)rwlock, impl, node);
+	return ret;
 #else
-	assert(0 && "rwlock not supported without indirection");
+	return lock_mutex_trylock((lock_mutex_t *) rwlock, NULL);
 #endif
 }
 
@@ -839,12 +1348,57 @@ int pthread_rwlock_unlock(pthread_rwlock_t * rwlock)
 {
 	DEBUG_PTHREAD("[p] pthread_rwlock_unlock\n");
 #if !NO_INDIRECTION
-	lock_transparent_mutex_t *impl = ht_lock_get((void *)rwlock);
-	lock_mutex_unlock(impl->lock_lock, get_node(impl));
+	lock_context_t *node;
+	lock_transparent_mutex_t *impl =
+	    ht_lock_held_pop((void *)rwlock, &node);
+	lock_mutex_unlock(impl->lock_lock, node);
 	return 0;
 #else
-	assert(0 && "rwlock not supported without indirection");
+	lock_mutex_unlock((lock_mutex_t *) rwlock, NULL);
+	return 0;
 #endif
 }
 
 #endif
+
+// Binaries linked against glibc 2.34 or later reference the GLIBC_2.34
+// version of these functions (as for pthread_create above)
+#define LP_GLIBC_2_34(ret, name, params, args)				\
+	__asm__(".symver " #name "_2_34," #name "@GLIBC_2.34");	\
+	ret name##_2_34 params;						\
+	ret name##_2_34 params						\
+	{								\
+		return name args;					\
+	}
+
+LP_GLIBC_2_34(int, pthread_mutex_trylock, (pthread_mutex_t * m), (m))
+LP_GLIBC_2_34(int, pthread_mutex_timedlock,
+	      (pthread_mutex_t * m, const struct timespec * t), (m, t))
+LP_GLIBC_2_34(int, pthread_mutex_clocklock,
+	      (pthread_mutex_t * m, clockid_t c, const struct timespec * t),
+	      (m, c, t))
+LP_GLIBC_2_34(int, pthread_rwlock_init,
+	      (pthread_rwlock_t * l, const pthread_rwlockattr_t * a), (l, a))
+LP_GLIBC_2_34(int, pthread_rwlock_destroy, (pthread_rwlock_t * l), (l))
+LP_GLIBC_2_34(int, pthread_rwlock_rdlock, (pthread_rwlock_t * l), (l))
+LP_GLIBC_2_34(int, pthread_rwlock_wrlock, (pthread_rwlock_t * l), (l))
+LP_GLIBC_2_34(int, pthread_rwlock_tryrdlock, (pthread_rwlock_t * l), (l))
+LP_GLIBC_2_34(int, pthread_rwlock_trywrlock, (pthread_rwlock_t * l), (l))
+LP_GLIBC_2_34(int, pthread_rwlock_unlock, (pthread_rwlock_t * l), (l))
+LP_GLIBC_2_34(int, pthread_rwlock_timedrdlock,
+	      (pthread_rwlock_t * l, const struct timespec * t), (l, t))
+LP_GLIBC_2_34(int, pthread_rwlock_timedwrlock,
+	      (pthread_rwlock_t * l, const struct timespec * t), (l, t))
+LP_GLIBC_2_34(int, pthread_rwlock_clockrdlock,
+	      (pthread_rwlock_t * l, clockid_t c, const struct timespec * t),
+	      (l, c, t))
+LP_GLIBC_2_34(int, pthread_rwlock_clockwrlock,
+	      (pthread_rwlock_t * l, clockid_t c, const struct timespec * t),
+	      (l, c, t))
+#if SUPPORT_SPINLOCK
+LP_GLIBC_2_34(int, pthread_spin_init, (pthread_spinlock_t * s, int p), (s, p))
+LP_GLIBC_2_34(int, pthread_spin_destroy, (pthread_spinlock_t * s), (s))
+LP_GLIBC_2_34(int, pthread_spin_lock, (pthread_spinlock_t * s), (s))
+LP_GLIBC_2_34(int, pthread_spin_trylock, (pthread_spinlock_t * s), (s))
+LP_GLIBC_2_34(int, pthread_spin_unlock, (pthread_spinlock_t * s), (s))
+#endif
@@ -26,6 +26,18 @@
 
 #define NUM_BUCKETS 1024
 
+#ifdef MCS
+#include <mcs.h>
+#elif defined(HTLL)
+#include <htll.h>
+#elif defined(PTHREADINTERPOSE)
+#include <pthreadinterpose.h>
+#else
+#error "No lock algorithm known"
+#endif
+
+#include "utils.h"
+
 #ifndef FCT_LINK_SUFFIX
 #error "Please define FCT_LINK_SUFFIX before including interpose.h"
 #endif
@@ -55,6 +67,9 @@ extern int (*REAL(pthread_mutex_init))(pthread_mutex_t *mutex,
 extern int (*REAL(pthread_mutex_destroy))(pthread_mutex_t *mutex);
 extern int (*REAL(pthread_mutex_lock))(pthread_mutex_t *mutex);
 extern int (*REAL(pthread_mutex_timedlock))(pthread_mutex_t *mutex, const struct timespec *abstime);
+extern int (*REAL(pthread_mutex_clocklock))(pthread_mutex_t *mutex,
+                                            clockid_t clockid,
+                                            const struct timespec *abstime);
 extern int (*REAL(pthread_mutex_trylock))(pthread_mutex_t *mutex);
 extern int (*REAL(pthread_mutex_unlock))(pthread_mutex_t *mutex);
 extern int (*REAL(pthread_create))(pthread_t *thread,
@@ -94,4 +109,36 @@ extern int (*REAL(pthread_rwlock_trywrlock))(pthread_rwlock_t *lock);
 extern int (*REAL(pthread_rwlock_unlock))(pthread_rwlock_t *lock);
 
 // rdwr locks
+
+// Per-thread block of the library, one slot per thread id (slots are reused
+// along with the ids)
+typedef struct lp_thread {
+    unsigned int id;
+    // Kernel thread id if the thread attached again after its teardown, so
+    // that its id is released once it is gone (0 otherwise)
+    pid_t late;
+    // Start routine, for the threads created through pthread_create
+    void *(*fct)(void *);
+    void *arg;
+    // Per-thread state of the lock algorithm
+    lock_thread_t lock;
+} __attribute__((aligned(L_CACHE_LINE_SIZE))) lp_thread_t;
+
+// Initial-exec: the library is preloaded, so the pointer lives in the static
+// TLS block and is reached without a call to __tls_get_addr
+extern __thread lp_thread_t *lp_self __attribute__((tls_model("initial-exec")));
+// lp_self once the thread released its block: a lock taken by a later
+// destructor attaches it again, and glibc may not run lp_thread_exit twice
+#define LP_EXITED ((lp_thread_t *)1)
+
+lp_thread_t *lp_thread_attach(void);
+
+// Block of the calling thread; threads that were not created through the
+// library get one on first use
+static inline lp_thread_t *lp_thread(void) {
+    lp_thread_t *t = lp_self;
+    if (__builtin_expect((uintptr_t)t <= (uintptr_t)LP_EXITED, 0))
+        t = lp_thread_attach();
+    return t;
+}
 #endif // __INTERPOSE_H__
@@ -0,0 +1,390 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "locktable.h"
+#include "ebr.h"
+
+/*
+ * Slot life cycle:
+ *   key:   NULL -> key                    (claimed by an insertion)
+ *          NULL -> LT_KEY_SEALED          (empty slot of a table being copied)
+ *   value: NULL -> value                  (published right after the claim)
+ *          value <-> LT_TOMBSTONE         (removed / inserted again)
+ *          value -> value | LT_PRIMED     (being copied by a single thread)
+ *          value | LT_PRIMED -> LT_MOVED  (copied to the next table)
+ *          LT_TOMBSTONE -> LT_MOVED       (dropped by the copy)
+ *
+ * A key never moves inside a table, so a probe sequence only has to stop at
+ * the first empty (or sealed) slot.  Once a table has a successor, no key may
+ * be claimed in it anymore: empty slots met by an insertion are sealed before
+ * going to the next table.  This is what guarantees that two racing
+ * insertions of the same key cannot end up in two different tables.
+ * A primed value is still live but frozen: it can neither be removed nor
+ * replaced until its copy is done, so the copy cannot resurrect a removed key.
+ * Values must therefore be at least 8-byte aligned.
+ */
+#define LT_KEY_SEALED	((void *)1)
+#define LT_MOVED	((void *)2)
+#define LT_TOMBSTONE	((void *)4)
+#define LT_PRIMED	1UL
+
+#define LT_INITIAL_BITS	12
+#define LT_MAX_PROBES	64
+#define LT_COPY_CHUNK	256
+
+struct lt_slot {
+	void *key;
+	void *value;
+};
+
+struct lt_table {
+	struct lt_table *next;
+	uint64_t bits;
+	uint64_t mask;
+	char __pad0[pad_to_cache_line(sizeof(void *) + 2 * sizeof(uint64_t))];
+	/* Number of claimed slots, and of removed entries among them */
+	uint64_t used;
+	uint64_t dead;
+	char __pad1[pad_to_cache_line(2 * sizeof(uint64_t))];
+	/* Incremental copy to the next table */
+	uint64_t copy_idx;
+	uint64_t copy_done;
+	char __pad2[pad_to_cache_line(2 * sizeof(uint64_t))];
+	struct lt_slot slots[];
+};
+
+static struct lt_table *lt_root;
+
+static inline uint64_t lt_hash(struct lt_table *t, void *key)
+{
+	return ((uint64_t) key * 0x9E3779B97F4A7C15ULL) >> (64 - t->bits);
+}
+
+static inline void *lt_load(void **p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline int lt_is_primed(void *v)
+{
+	return (uintptr_t) v & LT_PRIMED;
+}
+
+static inline void *lt_unprime(void *v)
+{
+	return (void *)((uintptr_t) v & ~LT_PRIMED);
+}
+
+static inline int lt_cas(void **p, void *expected, void *desired)
+{
+	return __atomic_compare_exchange_n(p, &expected, desired, 0,
+					   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static struct lt_table *lt_alloc(uint64_t bits)
+{
+	size_t size = sizeof(struct lt_table) +
+	    (sizeof(struct lt_slot) << bits);
+	/* Anonymous mappings are zero-filled on first touch: no memset */
+	struct lt_table *t = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				  -1, 0);
+	if (t == MAP_FAILED) {
+		fprintf(stderr, "Unable to allocate the lock table (LitL)\n");
+		exit(-1);
+	}
+	t->bits = bits;
+	t->mask = (1ULL << bits) - 1;
+	return t;
+}
+
+static void lt_free(void *p)
+{
+	struct lt_table *t = p;
+	munmap(t, sizeof(struct lt_table) + (sizeof(struct lt_slot) << t->bits));
+}
+
+static struct lt_table *lt_current(void)
+{
+	struct lt_table *t = lt_load((void **)&lt_root);
+	if (__builtin_expect(t != NULL, 1))
+		return t;
+
+	t = lt_alloc(LT_INITIAL_BITS);
+	if (!lt_cas((void **)&lt_root, NULL, t)) {
+		lt_free(t);
+		t = lt_load((void **)&lt_root);
+	}
+	return t;
+}
+
+/* Smallest table holding the live entries of t at most one quarter full */
+static uint64_t lt_live_bits(struct lt_table *t)
+{
+	uint64_t used = __atomic_load_n(&t->used, __ATOMIC_RELAXED);
+	uint64_t dead = __atomic_load_n(&t->dead, __ATOMIC_RELAXED);
+	uint64_t live = used > dead ? used - dead : 0;
+	uint64_t bits = LT_INITIAL_BITS;
+
+	while ((1ULL << bits) < 4 * live)
+		bits++;
+	return bits;
+}
+
+static struct lt_table *lt_resize(struct lt_table *t, uint64_t bits)
+{
+	struct lt_table *next = lt_load((void **)&t->next);
+	if (next)
+		return next;
+
+	next = lt_alloc(bits);
+	if (!lt_cas((void **)&t->next, NULL, next)) {
+		lt_free(next);
+		next = lt_load((void **)&t->next);
+	}
+	return next;
+}
+
+/* An insertion is in progress: the value follows the key claim shortly */
+static inline void *lt_wait_value(struct lt_slot *s)
+{
+	void *v;
+	while ((v = lt_load(&s->value)) == NULL)
+		CPU_PAUSE();
+	return v;
+}
+
+/* Another thread is copying the slot */
+static inline void lt_wait_moved(struct lt_slot *s)
+{
+	while (lt_load(&s->value) != LT_MOVED)
+		CPU_PAUSE();
+}
+
+static void *lt_put(struct lt_table *t, void *key, void *value);
+
+static void lt_copy_slot(struct lt_table *t, uint64_t idx)
+{
+	struct lt_slot *s = &t->slots[idx];
+	void *k = lt_load(&s->key);
+
+	if (k == NULL) {
+		if (lt_cas(&s->key, NULL, LT_KEY_SEALED))
+			return;
+		k = lt_load(&s->key);
+	}
+	if (k == LT_KEY_SEALED)
+		return;
+
+	void *v = lt_wait_value(s);
+	for (;;) {
+		if (v == LT_MOVED)
+			return;
+		if (lt_is_primed(v)) {
+			lt_wait_moved(s);
+			return;
+		}
+		if (v == LT_TOMBSTONE) {
+			if (lt_cas(&s->value, v, LT_MOVED))
+				return;
+		} else if (lt_cas(&s->value, v, (void *)((uintptr_t) v |
+							  LT_PRIMED))) {
+			lt_put(t->next, k, v);
+			__atomic_store_n(&s->value, LT_MOVED, __ATOMIC_RELEASE);
+			return;
+		}
+		v = lt_load(&s->value);
+	}
+}
+
+/* Copy one chunk of t into its successor, promote the successor when done */
+static void lt_help_copy(struct lt_table *t)
+{
+	uint64_t size = t->mask + 1;
+	uint64_t start = __atomic_load_n(&t->copy_idx, __ATOMIC_RELAXED);
+	if (start < size)
+		start = __atomic_fetch_add(&t->copy_idx, LT_COPY_CHUNK,
+					   __ATOMIC_RELAXED);
+	if (start < size) {
+		uint64_t end = start + LT_COPY_CHUNK > size ? size :
+		    start + LT_COPY_CHUNK;
+		for (uint64_t i = start; i < end; i++)
+			lt_copy_slot(t, i);
+		__atomic_add_fetch(&t->copy_done, end - start,
+				   __ATOMIC_ACQ_REL);
+	}
+
+	/*
+	 * Also retried once the copy is over: a nested successor may finish
+	 * before its predecessor is promoted.
+	 */
+	if (__atomic_load_n(&t->copy_done, __ATOMIC_ACQUIRE) == size &&
+	    lt_cas((void **)&lt_root, t, t->next))
+		ebr_retire(t, lt_free);
+}
+
+static void *lt_put(struct lt_table *t, void *key, void *value)
+{
+	struct lt_table *next;
+
+ again:
+	next = lt_load((void **)&t->next);
+	if (next)
+		lt_help_copy(t);
+
+	uint64_t idx = lt_hash(t, key);
+	for (int probe = 0; probe < LT_MAX_PROBES; probe++) {
+		struct lt_slot *s = &t->slots[idx];
+		void *k = lt_load(&s->key);
+
+		if (k == NULL) {
+			if (next == NULL)
+				next = lt_load((void **)&t->next);
+			if (next == NULL) {
+				if (lt_cas(&s->key, NULL, key)) {
+					__atomic_store_n(&s->value, value,
+							 __ATOMIC_RELEASE);
+					uint64_t used =
+					    __atomic_add_fetch(&t->used, 1,
+							       __ATOMIC_RELAXED);
+					if (used > (t->mask + 1) / 2)
+						lt_resize(t, lt_live_bits(t));
+					return value;
+				}
+			} else if (lt_cas(&s->key, NULL, LT_KEY_SEALED)) {
+				/* The key cannot be here anymore */
+				t = next;
+				goto again;
+			}
+			k = lt_load(&s->key);
+		}
+
+		if (k == key) {
+			void *v = lt_wait_value(s);
+			while (v == LT_TOMBSTONE) {
+				if (lt_cas(&s->value, v, value)) {
+					__atomic_sub_fetch(&t->dead, 1,
+							   __ATOMIC_RELAXED);
+					return value;
+				}
+				v = lt_load(&s->value);
+			}
+			if (v != LT_MOVED)
+				return lt_unprime(v);
+			t = lt_load((void **)&t->next);
+			goto again;
+		}
+
+		if (k == LT_KEY_SEALED) {
+			t = lt_load((void **)&t->next);
+			goto again;
+		}
+
+		idx = (idx + 1) & t->mask;
+	}
+
+	/* Too many collisions, grow (or at least rehash) */
+	uint64_t bits = lt_live_bits(t);
+	t = lt_resize(t, bits > t->bits ? bits : t->bits + 1);
+	goto again;
+}
+
+static void *lt_remove(struct lt_table *t, void *key)
+{
+	while (t) {
+		if (lt_load((void **)&t->next))
+			lt_help_copy(t);
+
+		uint64_t idx = lt_hash(t, key);
+		for (int probe = 0; probe < LT_MAX_PROBES; probe++) {
+			struct lt_slot *s = &t->slots[idx];
+			void *k = lt_load(&s->key);
+
+			if (k == NULL)
+				return NULL;
+			if (k == LT_KEY_SEALED)
+				break;
+			if (k == key) {
+				void *v = lt_wait_value(s);
+				for (;;) {
+					if (lt_is_primed(v)) {
+						lt_wait_moved(s);
+						v = LT_MOVED;
+					}
+					if (v == LT_MOVED || v == LT_TOMBSTONE)
+						break;
+					if (lt_cas(&s->value, v, LT_TOMBSTONE)) {
+						__atomic_add_fetch(&t->dead, 1,
+								   __ATOMIC_RELAXED);
+						return v;
+					}
+					v = lt_load(&s->value);
+				}
+				if (v == LT_TOMBSTONE)
+					return NULL;
+				break;
+			}
+
+			idx = (idx + 1) & t->mask;
+		}
+		t = lt_load((void **)&t->next);
+	}
+	return NULL;
+}
+
+void *lock_table_put(void *key, void *value)
+{
+	ebr_enter();
+	value = lt_put(lt_current(), key, value);
+	ebr_exit();
+	return value;
+}
+
+void *lock_table_remove(void *key)
+{
+	ebr_enter();
+	void *value = lt_remove(lt_current(), key);
+	ebr_exit();
+	return value;
+}
+
+void *lock_table_get(void *key)
+{
+	void *value = NULL;
+
+	ebr_enter();
+	struct lt_table *t = lt_current();
+	while (t) {
+		uint64_t idx = lt_hash(t, key);
+		for (int probe = 0; probe < LT_MAX_PROBES; probe++) {
+			struct lt_slot *s = &t->slots[idx];
+			void *k = lt_load(&s->key);
+
+			if (k == key) {
+				void *v = lt_wait_value(s);
+				if (v == LT_TOMBSTONE)
+					goto out;
+				if (v != LT_MOVED) {
+					value = lt_unprime(v);
+					goto out;
+				}
+				break;
+			}
+			if (k == NULL || k == LT_KEY_SEALED)
+				break;
+
+			idx = (idx + 1) & t->mask;
+		}
+		t = lt_load((void **)&t->next);
+	}
+ out:
+	ebr_exit();
+	return value;
+}
@@ -0,0 +1,26 @@
+#ifndef __LOCKTABLE_H__
+#define __LOCKTABLE_H__
+
+/*
+ * Lock-free map from a pthread object address (mutex, rwlock, ...) to the
+ * lock structure that replaces it.
+ *
+ * Open addressing with linear probing.  Tables are mmap-backed, so the pages
+ * are only faulted in when a bucket is first used.  When a table gets half
+ * full it is rehashed into a table sized after its live entries: it doubles
+ * under growth and is compacted when it mostly holds removed entries.  The
+ * migration to the new table is done incrementally by the threads inserting
+ * new entries, and replaced tables are reclaimed through ebr.h.  Lookups
+ * never help.
+ *
+ * lock_table_put() is a put-if-absent: when several threads race to insert
+ * the same key, all of them get back the same value (the first one to be
+ * published).  lock_table_remove() returns the removed value, which the
+ * caller must retire (ebr_retire) since lookups may still be using it.
+ */
+
+void *lock_table_get(void *key);
+void *lock_table_put(void *key, void *value);
+void *lock_table_remove(void *key);
+
+#endif // __LOCKTABLE_H__
@@ -0,0 +1,158 @@
+/*
+ * MCS queue lock (Mellor-Crummey and Scott, 1991). Waiters queue up in FIFO
+ * order, each one waiting on its own node with the generic waiting policy.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <assert.h>
+#include <mcs.h>
+
+#include "waiting_policy.h"
+#include "interpose.h"
+#include "utils.h"
+
+static inline long mcs_futex(volatile int *uaddr, int op, int val,
+                             const struct timespec *timeout, int val3) {
+    return syscall(SYS_futex, uaddr, op, val, timeout, NULL, val3);
+}
+
+mcs_mutex_t *mcs_mutex_create(const pthread_mutexattr_t *UNUSED(attr)) {
+    mcs_mutex_t *impl = (mcs_mutex_t *)alloc_cache_align(sizeof(mcs_mutex_t));
+    impl->tail = NULL;
+    return impl;
+}
+
+int mcs_mutex_lock(mcs_mutex_t *impl, mcs_node_t *me) {
+    me->next = NULL;
+    me->spin = LOCKED;
+
+    // The exchange is a full barrier: the node is ready before it is seen
+    mcs_node_t *pred = __atomic_exchange_n(&impl->tail, me, __ATOMIC_SEQ_CST);
+    if (!pred)
+        return 0;
+
+    pred->next = me;
+    waiting_policy_sleep(&me->spin);
+    return 0;
+}
+
+int mcs_mutex_trylock(mcs_mutex_t *impl, mcs_node_t *me) {
+    mcs_node_t *idle = NULL;
+
+    me->next = NULL;
+    me->spin = LOCKED;
+    if (__atomic_compare_exchange_n(&impl->tail, &idle, me, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return 0;
+    return EBUSY;
+}
+
+/**
+ * A queued waiter cannot leave the queue, so a deadline is only honored by
+ * retrying trylock until it expires.
+ **/
+int mcs_mutex_timedlock(mcs_mutex_t *impl, mcs_node_t *me, clockid_t clock,
+                        const struct timespec *abstime) {
+    if ((clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME) ||
+        abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+        return EINVAL;
+
+    while (mcs_mutex_trylock(impl, me) != 0) {
+        struct timespec now;
+        clock_gettime(clock, &now);
+        if (now.tv_sec > abstime->tv_sec ||
+            (now.tv_sec == abstime->tv_sec && now.tv_nsec >= abstime->tv_nsec))
+            return ETIMEDOUT;
+        sched_yield();
+    }
+    return 0;
+}
+
+void mcs_mutex_unlock(mcs_mutex_t *impl, mcs_node_t *me) {
+    mcs_node_t *succ = me->next;
+
+    if (!succ) {
+        mcs_node_t *expected = me;
+        if (__atomic_compare_exchange_n(&impl->tail, &expected, NULL, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return;
+        // A successor swapped itself in, wait until it links its node
+        while (!(succ = me->next))
+            CPU_PAUSE();
+    }
+    waiting_policy_wake(&succ->spin);
+}
+
+int mcs_mutex_destroy(mcs_mutex_t *lock) {
+    free(lock);
+    return 0;
+}
+
+int mcs_cond_init(mcs_cond_t *cond, const pthread_condattr_t *UNUSED(attr)) {
+    cond->seq = 0;
+    return 0;
+}
+
+int mcs_cond_timedwait(mcs_cond_t *cond, mcs_mutex_t *lock, mcs_node_t *me,
+                       const struct timespec *ts) {
+    int seq = cond->seq;
+    int res = 0;
+
+    mcs_mutex_unlock(lock, me);
+    if (ts) {
+        // pthread_cond_timedwait deadlines are on CLOCK_REALTIME
+        if (mcs_futex(&cond->seq,
+                      FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, seq,
+                      ts, FUTEX_BITSET_MATCH_ANY) == -1 &&
+            errno == ETIMEDOUT)
+            res = ETIMEDOUT;
+    } else {
+        mcs_futex(&cond->seq, FUTEX_WAIT_PRIVATE, seq, NULL, 0);
+    }
+    mcs_mutex_lock(lock, me);
+    return res;
+}
+
+int mcs_cond_wait(mcs_cond_t *cond, mcs_mutex_t *lock, mcs_node_t *me) {
+    return mcs_cond_timedwait(cond, lock, me, NULL);
+}
+
+int mcs_cond_signal(mcs_cond_t *cond) {
+    __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    mcs_futex(&cond->seq, FUTEX_WAKE_PRIVATE, 1, NULL, 0);
+    return 0;
+}
+
+int mcs_cond_broadcast(mcs_cond_t *cond) {
+    __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    mcs_futex(&cond->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, 0);
+    return 0;
+}
+
+int mcs_cond_destroy(mcs_cond_t *UNUSED(cond)) {
+    return 0;
+}
+
+void mcs_thread_start(void) {
+}
+
+void mcs_thread_exit(void) {
+}
+
+void mcs_application_init(void) {
+}
+
+void mcs_application_exit(void) {
+}
+
+void mcs_init_context(lock_mutex_t *UNUSED(impl), lock_context_t *context,
+                      int UNUSED(number)) {
+    context->next = NULL;
+    context->spin = LOCKED;
+}
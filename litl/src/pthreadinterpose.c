@@ -37,8 +37,6 @@
 #include "interpose.h"
 #include "utils.h"
 
-extern __thread unsigned int cur_thread_id;
-
 pthread_interpose_mutex_t *
 pthread_interpose_mutex_create(const pthread_mutexattr_t *attr) {
     pthread_interpose_mutex_t *impl =
@@ -80,6 +78,25 @@ int pthread_interpose_mutex_trylock(pthread_interpose_mutex_t *impl,
     return EBUSY;
 }
 
+int pthread_interpose_mutex_timedlock(pthread_interpose_mutex_t *impl,
+                                      pthread_interpose_context_t *UNUSED(me),
+                                      clockid_t clock,
+                                      const struct timespec *abstime) {
+    int ret;
+    if (clock == CLOCK_REALTIME)
+        ret = REAL(pthread_mutex_timedlock)(&impl->lock, abstime);
+    else
+        ret = REAL(pthread_mutex_clocklock)(&impl->lock, clock, abstime);
+    if (ret != 0)
+        return ret;
+#if COND_VAR
+    ret = REAL(pthread_mutex_lock)(&impl->posix_lock);
+    assert(ret == 0);
+#endif
+
+    return 0;
+}
+
 void pthread_interpose_mutex_unlock(pthread_interpose_mutex_t *impl,
                                     pthread_interpose_context_t *UNUSED(me)) {
 #if COND_VAR
@@ -0,0 +1,99 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "utils.h"
+#include "slab.h"
+
+#define SLAB_MIN_CHUNK	(64 * 1024)
+#define SLAB_MIN_OBJS	16
+
+// Stored at the beginning of every chunk
+struct slab_chunk {
+	int node;
+};
+
+static inline size_t slab_obj_size(slab_t * s)
+{
+	return r_align(s->size, s->align);
+}
+
+static inline size_t slab_chunk_size(slab_t * s)
+{
+	size_t chunk = SLAB_MIN_CHUNK;
+	while (chunk < SLAB_MIN_OBJS * slab_obj_size(s))
+		chunk <<= 1;
+	return chunk;
+}
+
+static inline void slab_lock(slab_node_t * n)
+{
+	while (__sync_lock_test_and_set(&n->lock, 1))
+		while (n->lock)
+			CPU_PAUSE();
+}
+
+static inline void slab_unlock(slab_node_t * n)
+{
+	__sync_lock_release(&n->lock);
+}
+
+static void slab_refill(slab_t * s, slab_node_t * n, int node)
+{
+	size_t chunk = slab_chunk_size(s);
+	// Over-allocate to align the chunk on its size, so that the header of
+	// any object is found by masking its address
+	char *raw = mmap(NULL, 2 * chunk, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) {
+		fprintf(stderr, "Unable to allocate lock objects (LitL)\n");
+		exit(-1);
+	}
+	char *start = (char *)r_align((uintptr_t) raw, chunk);
+	if (start != raw)
+		munmap(raw, start - raw);
+	if (raw + chunk != start)
+		munmap(start + chunk, raw + chunk - start);
+
+	((struct slab_chunk *)start)->node = node;
+	n->bump = start + r_align(sizeof(struct slab_chunk), s->align);
+	n->end = start + chunk;
+}
+
+void *slab_alloc(slab_t * s)
+{
+	int node = current_numa_node() % SLAB_MAX_NODES;
+	slab_node_t *n = &s->nodes[node];
+	size_t size = slab_obj_size(s);
+	void *p;
+
+	slab_lock(n);
+	p = n->free;
+	if (p) {
+		n->free = *(void **)p;
+	} else {
+		if (n->bump + size > n->end)
+			slab_refill(s, n, node);
+		p = n->bump;
+		n->bump += size;
+	}
+	slab_unlock(n);
+	return p;
+}
+
+void slab_free(slab_t * s, void *p)
+{
+	struct slab_chunk *c =
+	    (struct slab_chunk *)((uintptr_t) p & ~(slab_chunk_size(s) - 1));
+	slab_node_t *n = &s->nodes[c->node];
+
+	slab_lock(n);
+	*(void **)p = n->free;
+	n->free = p;
+	slab_unlock(n);
+}
@@ -0,0 +1,39 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+/*
+ * Fixed-size allocator for the lock objects.
+ *
+ * Each slab serves objects of one size and alignment, carved out of large
+ * aligned chunks.  Every NUMA node has its own chunks and free list, and a
+ * chunk is first touched by a thread running on the node it serves, so with
+ * the default first-touch policy a lock lives on the node of the thread that
+ * created it.  A freed object goes back to the free list of its chunk's node.
+ * Chunks are never returned to the system.
+ */
+
+#include <stddef.h>
+#include "utils.h"
+
+#define SLAB_MAX_NODES	8
+
+typedef struct slab_node {
+	void *free;
+	char *bump;
+	char *end;
+	volatile int lock;
+	char __pad[pad_to_cache_line(3 * sizeof(void *) + sizeof(int))];
+} slab_node_t __attribute__((aligned(L_CACHE_LINE_SIZE)));
+
+typedef struct slab {
+	size_t size;
+	size_t align;
+	slab_node_t nodes[SLAB_MAX_NODES];
+} slab_t;
+
+#define SLAB_INITIALIZER(size, align) { (size), (align), { { 0 } } }
+
+void *slab_alloc(slab_t * s);
+void slab_free(slab_t * s, void *p);
+
+#endif // __SLAB_H__
@@ -0,0 +1,65 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "tid.h"
+
+extern unsigned int last_thread_id;
+
+// Lock-free stack of the released ids: the head packs a tag, bumped on every
+// change against ABA, with id + 1 of the top entry (0 when empty)
+static volatile uint64_t tid_head __attribute__((aligned(L_CACHE_LINE_SIZE)));
+static volatile uint32_t tid_next[MAX_THREADS];
+
+static int tid_pop(void)
+{
+	uint64_t head = __atomic_load_n(&tid_head, __ATOMIC_ACQUIRE);
+
+	while ((uint32_t) head != 0) {
+		unsigned int id = (uint32_t) head - 1;
+		uint64_t next = (((head >> 32) + 1) << 32) | tid_next[id];
+		if (__atomic_compare_exchange_n(&tid_head, &head, next, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_ACQUIRE))
+			return id;
+	}
+	return -1;
+}
+
+int tid_alloc(void)
+{
+	for (;;) {
+		int id = tid_pop();
+		if (id >= 0)
+			return id;
+
+		// Nothing to recycle: take a new id
+		unsigned int n =
+		    __atomic_load_n(&last_thread_id, __ATOMIC_RELAXED);
+		while (n < MAX_THREADS) {
+			if (__atomic_compare_exchange_n(&last_thread_id, &n,
+							n + 1, 0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				return n;
+		}
+		if ((uint32_t) __atomic_load_n(&tid_head, __ATOMIC_ACQUIRE) == 0)
+			return -1;
+	}
+}
+
+void tid_free(unsigned int id)
+{
+	uint64_t head = __atomic_load_n(&tid_head, __ATOMIC_RELAXED);
+	uint64_t next;
+
+	do {
+		tid_next[id] = (uint32_t) head;
+		next = (((head >> 32) + 1) << 32) | (id + 1);
+	} while (!__atomic_compare_exchange_n(&tid_head, &head, next, 0,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
@@ -0,0 +1,16 @@
+#ifndef __TID_H__
+#define __TID_H__
+
+/*
+ * Thread ids, used to index the per-thread slots of the library.
+ *
+ * An id is released when its thread exits and handed to a later thread, so
+ * MAX_THREADS bounds the number of live threads, not the number of threads
+ * ever created.  last_thread_id is the high-water mark of the ids in use.
+ */
+
+// Returns -1 when MAX_THREADS threads are alive
+int tid_alloc(void);
+void tid_free(unsigned int id);
+
+#endif // __TID_H__
@@ -0,0 +1,91 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <cpuid.h>
+#include <time.h>
+
+#include "timebase.h"
+
+// Length of the measurement when CPUID does not give the TSC frequency
+#define TIMEBASE_CALIBRATION_NS	2000000
+
+int timebase_tsc = 0;
+uint64_t timebase_ticks_per_ns = 1ULL << 32;
+uint64_t timebase_ns_per_tick = 1ULL << 32;
+
+static inline uint64_t rdtsc(void)
+{
+	unsigned hi, lo;
+	__asm__ __volatile__("rdtsc":"=a"(lo), "=d"(hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+static inline uint64_t raw_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Clock read paired with the TSC read closest to it
+static void sample(uint64_t * tsc, uint64_t * ns)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int i = 0; i < 5; i++) {
+		uint64_t before = rdtsc();
+		uint64_t t = raw_ns();
+		uint64_t after = rdtsc();
+		if (after - before < best) {
+			best = after - before;
+			*tsc = before + (after - before) / 2;
+			*ns = t;
+		}
+	}
+}
+
+// Returns 0 when the TSC is not usable as a time base
+static uint64_t tsc_hz(void)
+{
+	unsigned int a, b, c, d;
+
+	// The TSC must tick at a constant rate, in every C/P-state
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8)))
+		return 0;
+
+	// Crystal clock and TSC ratio, when reported
+	if (__get_cpuid_max(0, NULL) >= 0x15) {
+		__cpuid(0x15, a, b, c, d);
+		if (a && b && c)
+			return (uint64_t) c *b / a;
+	}
+
+	uint64_t tsc0, ns0, tsc1, ns1;
+	struct timespec pause = { 0, TIMEBASE_CALIBRATION_NS };
+	sample(&tsc0, &ns0);
+	nanosleep(&pause, NULL);
+	sample(&tsc1, &ns1);
+	if (ns1 <= ns0 || tsc1 <= tsc0)
+		return 0;
+	return (unsigned __int128)(tsc1 - tsc0) * 1000000000ULL / (ns1 - ns0);
+}
+
+void timebase_init(void)
+{
+	uint64_t hz = tsc_hz();
+
+	if (!hz)
+		return;
+	timebase_ticks_per_ns = ((unsigned __int128)hz << 32) / 1000000000ULL;
+	timebase_ns_per_tick = (1000000000ULL << 32) / hz;
+	__atomic_store_n(&timebase_tsc, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t timebase_hz(void)
+{
+	return timebase_tsc ? ((unsigned __int128)timebase_ticks_per_ns *
+			       1000000000ULL) >> 32 : 1000000000ULL;
+}
@@ -0,0 +1,49 @@
+#ifndef __TIMEBASE_H__
+#define __TIMEBASE_H__
+
+/*
+ * Calibrated time base.
+ *
+ * Timing parameters are expressed in nanoseconds and converted once to ticks,
+ * the unit of timebase_ticks(): the TSC when it is invariant (its frequency
+ * read from CPUID or measured against CLOCK_MONOTONIC_RAW at startup), and
+ * nanoseconds from clock_gettime otherwise.  Until timebase_init runs, ticks
+ * are nanoseconds.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+extern int timebase_tsc;
+// Ticks per nanosecond and nanoseconds per tick, 32.32 fixed point
+extern uint64_t timebase_ticks_per_ns;
+extern uint64_t timebase_ns_per_tick;
+
+void timebase_init(void);
+// Frequency of the ticks, in Hz
+uint64_t timebase_hz(void);
+
+static inline uint64_t timebase_ticks(void)
+{
+	if (__builtin_expect(timebase_tsc, 1)) {
+		unsigned hi, lo;
+		__asm__ __volatile__("rdtsc":"=a"(lo), "=d"(hi));
+		return ((uint64_t) hi << 32) | lo;
+	}
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t timebase_ns_to_ticks(uint64_t ns)
+{
+	return ((unsigned __int128)ns * timebase_ticks_per_ns) >> 32;
+}
+
+static inline uint64_t timebase_ticks_to_ns(uint64_t ticks)
+{
+	return ((unsigned __int128)ticks * timebase_ns_per_tick) >> 32;
+}
+
+#endif // __TIMEBASE_H__
@@ -34,9 +34,12 @@ __thread int lazy_cnt = 0;
 #endif
 
 
-// int current_numa_node(void) {
-//     return judge_numa_node(sched_getcpu());
-// }
+int current_numa_node(void) {
+    unsigned int cpu, node;
+    if (getcpu(&cpu, &node) < 0)
+        return 0;
+    return node;
+}
 
 int is_big_core(void) {
 #ifdef ENABLE_LAZY_CHECK
@@ -34,6 +34,20 @@
  **/
 #define SPINNING_THRESHOLD 4000LL
 
+/**
+ * WAITING_ADAPTIVE learns its spinning budget instead (see below). Until it
+ * has observed a wake-up, it assumes the context switch time above.
+ **/
+#define ADAPTIVE_WAKE_NS 9000
+#define ADAPTIVE_SPIN_MIN_NS 200
+#define ADAPTIVE_SPIN_MAX_NS 100000
+// Weight of a new sample in the averages: 1 / 2^shift
+#define ADAPTIVE_SHIFT 4
+// Fixed point unit of the miss rate
+#define ADAPTIVE_ONE 256
+// One wait out of ADAPTIVE_PROBE spins for the whole window regardless
+#define ADAPTIVE_PROBE 16
+
 /**
  * waiting_policy_sleep: wait until *var is 0 (and potentially send the thread
  * to sleep)
@@ -48,9 +62,12 @@
 #include <sys/time.h>
 #include <errno.h>
 #include "utils.h"
+#include "timebase.h"
 extern int spin_cnt;
 extern int park_cnt;
 extern int wake_cnt;
+// The counters are shared by all the waiting threads
+#define WAITING_COUNT(cnt) __atomic_add_fetch(&(cnt), 1, __ATOMIC_RELAXED)
 #define LOCKED 0
 #define UNLOCKED 1
 /**
@@ -59,13 +76,14 @@ extern int wake_cnt;
  */
 #if defined(WAITING_ORIGINAL) &&                                               \
     (defined(WAITING_SPINLOCK) || defined(WAITING_SPINLOCK_ATOMIC) ||          \
-     defined(WAITING_SPIN_THEN_PARK))
+     defined(WAITING_SPIN_THEN_PARK) || defined(WAITING_ADAPTIVE))
 #error "The lock algorithm used only support its original waiting policy"
 #endif
 
 #define __maybe_unused __attribute__((unused))
 
-#if defined(WAITING_PARK) || defined(WAITING_SPIN_THEN_PARK)
+#if defined(WAITING_PARK) || defined(WAITING_SPIN_THEN_PARK) ||               \
+    defined(WAITING_ADAPTIVE)
 static inline int sys_futex(int *uaddr, int op, int val,
                             const struct timespec *timeout, int *uaddr2,
                             int val3) {
@@ -110,7 +128,7 @@ static inline void waiting_policy_sleep(volatile int *var) {
     if (*var == UNLOCKED) {
         // printf("here return\n");
         // *var = 0;
-        spin_cnt++;
+        WAITING_COUNT(spin_cnt);
         return;
     }
         
@@ -129,7 +147,7 @@ static inline void waiting_policy_sleep(volatile int *var) {
              * Note: FUTEX_WAIT_PRIVATE acts like an atomic operation.
              **/
             if (errno == EAGAIN) {
-                spin_cnt++;
+                WAITING_COUNT(spin_cnt);
                 // printf("ddd\n");
                 DEBUG("[-1] Race\n");
                 break;
@@ -137,7 +155,7 @@ static inline void waiting_policy_sleep(volatile int *var) {
             perror("Unable to futex wait");
             exit(-1);
         }
-        park_cnt++;
+        WAITING_COUNT(park_cnt);
     }
 
     /**
@@ -145,7 +163,7 @@ static inline void waiting_policy_sleep(volatile int *var) {
      * (but eventually it is).
      * Maybe related to memory reordering?
      **/
-     park_cnt++;
+    WAITING_COUNT(park_cnt);
     while (*var != UNLOCKED)
         CPU_PAUSE();
 }
@@ -153,7 +171,7 @@ static inline void waiting_policy_sleep(volatile int *var) {
 
 static inline void waiting_policy_wake(volatile int *var) {
     if(*var == 0) {
-        wake_cnt++;
+        WAITING_COUNT(wake_cnt);
     }
     *var    = 1;
     int ret = sys_futex((int *)var, FUTEX_WAKE_PRIVATE, UNLOCKED, NULL, 0, 0);
@@ -162,6 +180,111 @@ static inline void waiting_policy_wake(volatile int *var) {
         exit(-1);
     }
 }
+#elif defined(WAITING_ADAPTIVE)
+#define WAITING_POLICY "WAITING_ADAPTIVE"
+
+/**
+ * Spin then park, with a spinning budget learned per call site of
+ * waiting_policy_sleep. Spinning longer than the cost of a wake-up does not
+ * pay, so the window is twice the observed wake-up latency, and the budget
+ * is the window scaled by the fraction of recent waits that ended while
+ * spinning (hits). Regular probes spin for the whole window, so that the
+ * budget can grow back once it has shrunk.
+ *
+ * The wake-up latency is sampled by the parked threads, from the time the
+ * waker stamped in a small table indexed by the cache line of the variable.
+ * Each slot has its own line, so that wakers of unrelated variables do not
+ * invalidate one another.
+ **/
+typedef struct {
+    // EWMA of the fraction of misses, out of ADAPTIVE_ONE
+    volatile unsigned int miss;
+    volatile unsigned int waits;
+    // EWMA of the wake-up latency, in ticks (0 until observed)
+    volatile uint64_t wake;
+} __attribute__((aligned(L_CACHE_LINE_SIZE))) waiting_adaptive_t;
+
+#define ADAPTIVE_WAKE_SLOTS 64
+static struct {
+    volatile uint64_t ts;
+} __attribute__((aligned(L_CACHE_LINE_SIZE)))
+waiting_wake_ts[ADAPTIVE_WAKE_SLOTS] __maybe_unused;
+
+static inline volatile uint64_t *waiting_wake_slot(volatile int *var) {
+    return &waiting_wake_ts[((uintptr_t)var / L_CACHE_LINE_SIZE) %
+                            ADAPTIVE_WAKE_SLOTS].ts;
+}
+
+static inline uint64_t waiting_ewma(uint64_t avg, uint64_t sample) {
+    return avg + (((int64_t)sample - (int64_t)avg) >> ADAPTIVE_SHIFT);
+}
+
+static inline void waiting_adaptive_sleep(volatile int *var,
+                                          waiting_adaptive_t *site) {
+    uint64_t start = timebase_ticks();
+    uint64_t wake  = site->wake ? site->wake
+                                : timebase_ns_to_ticks(ADAPTIVE_WAKE_NS);
+    uint64_t window = 2 * wake;
+    uint64_t budget = window;
+    if (site->waits++ % ADAPTIVE_PROBE)
+        budget = window * (ADAPTIVE_ONE - site->miss) / ADAPTIVE_ONE;
+    uint64_t min = timebase_ns_to_ticks(ADAPTIVE_SPIN_MIN_NS);
+    uint64_t max = timebase_ns_to_ticks(ADAPTIVE_SPIN_MAX_NS);
+    budget = budget < min ? min : budget > max ? max : budget;
+
+    while (*var != UNLOCKED && timebase_ticks() - start < budget)
+        CPU_PAUSE();
+
+    if (*var == UNLOCKED) {
+        site->miss = waiting_ewma(site->miss, 0);
+        WAITING_COUNT(spin_cnt);
+        return;
+    }
+
+    int ret;
+    while ((ret = sys_futex((int *)var, FUTEX_WAIT_PRIVATE, LOCKED, NULL, 0,
+                            0)) != 0) {
+        if (ret == -1 && errno != EINTR) {
+            // Released between the spin and the futex call
+            if (errno == EAGAIN)
+                break;
+            perror("Unable to futex wait");
+            exit(-1);
+        }
+    }
+    while (*var != UNLOCKED)
+        CPU_PAUSE();
+
+    uint64_t now     = timebase_ticks();
+    uint64_t woken   = *waiting_wake_slot(var);
+    if (ret == 0 && woken > start && woken < now)
+        site->wake = site->wake ? waiting_ewma(site->wake, now - woken)
+                                : now - woken;
+    site->miss = waiting_ewma(site->miss, ADAPTIVE_ONE);
+    WAITING_COUNT(park_cnt);
+}
+
+/**
+ * One learning state per call site: the waits of a given site (e.g., a queue
+ * lock waiting for its predecessor) tend to look alike.
+ **/
+#define waiting_policy_sleep(var)                                              \
+    do {                                                                       \
+        static waiting_adaptive_t __waiting_site;                              \
+        waiting_adaptive_sleep((var), &__waiting_site);                        \
+    } while (0)
+
+static inline void waiting_policy_wake(volatile int *var) {
+    if (*var == LOCKED)
+        WAITING_COUNT(wake_cnt);
+    *waiting_wake_slot(var) = timebase_ticks();
+    *var    = UNLOCKED;
+    int ret = sys_futex((int *)var, FUTEX_WAKE_PRIVATE, UNLOCKED, NULL, 0, 0);
+    if (ret == -1) {
+        perror("Unable to futex wake");
+        exit(-1);
+    }
+}
 #elif defined(WAITING_PARK)
 #define WAITING_POLICY "WAITING_PARK"
 static inline void waiting_policy_sleep(volatile int *var) {
@@ -204,7 +327,7 @@ static inline void waiting_policy_wake(volatile int *var) {
 #define WAITING_POLICY "WAITING_ORIGINAL"
 #else
 #error                                                                         \
-    "No waiting policy defined (WAITING_SPINLOCK | WAITING_SPINLOCK_ATOMIC | WAITING_SPIN_THEN_PARK | WAITING_PARK | WAITING_ORIGINAL)"
+    "No waiting policy defined (WAITING_SPINLOCK | WAITING_SPINLOCK_ATOMIC | WAITING_SPIN_THEN_PARK | WAITING_ADAPTIVE | WAITING_PARK | WAITING_ORIGINAL)"
 #endif
 
 #endif // __WAITING_POLICY_H__